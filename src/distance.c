@@ -0,0 +1,626 @@
+#include <float.h>
+#include <limits.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DIST_X86
+#endif
+
+#include "image_io.h"
+#include "distance.h"
+
+void nearest_centers_scalar(byte_t *data, double *centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane);
+void nearest_centers_avx2(byte_t *data, double *centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane);
+void nearest_centers_avx512(byte_t *data, double *centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane);
+void pack_fixed(byte_t *data, int *pairs_lo, int *pairs_hi, int n_px, int n_ch, int px_step, int ch_step);
+void nearest_centers_fixed_scalar(byte_t *data, short *fx_centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane);
+void nearest_centers_fixed_avx2(byte_t *data, short *fx_centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane);
+void nearest_centers_fixed_avx512(byte_t *data, short *fx_centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane);
+void nearest_centers_float_scalar(byte_t *data, float *f_centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane);
+void nearest_centers_float_avx2(byte_t *data, float *f_centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane);
+void nearest_centers_float_avx512(byte_t *data, float *f_centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane);
+void nearest_centers_scalar_ch(byte_t *data, double *centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane);
+void nearest_centers_avx2_ch(byte_t *data, double *centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane);
+void nearest_centers_avx512_ch(byte_t *data, double *centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane);
+void nearest_centers_fixed_scalar_ch(byte_t *data, short *fx_centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane);
+void nearest_centers_fixed_avx2_ch(byte_t *data, short *fx_centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane);
+void nearest_centers_fixed_avx512_ch(byte_t *data, short *fx_centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane);
+void nearest_centers_float_scalar_ch(byte_t *data, float *f_centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane);
+void nearest_centers_float_avx2_ch(byte_t *data, float *f_centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane);
+void nearest_centers_float_avx512_ch(byte_t *data, float *f_centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane);
+
+void (*nearest_kernel)(byte_t *, double *, int *, double *, int, int, int, int) = nearest_centers_scalar;
+void (*nearest_fixed_kernel)(byte_t *, short *, int *, double *, int, int, int, int) = nearest_centers_fixed_scalar;
+void (*nearest_float_kernel)(byte_t *, float *, int *, double *, int, int, int, int) = nearest_centers_float_scalar;
+
+int select_dist_kernel()
+{
+    // Checking once which vector extensions the CPU supports
+
+#ifdef DIST_X86
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+        nearest_kernel = nearest_centers_avx512;
+        nearest_fixed_kernel = nearest_centers_fixed_avx512;
+        nearest_float_kernel = nearest_centers_float_avx512;
+        return KERNEL_AVX512;
+    }
+
+    if (__builtin_cpu_supports("avx2")) {
+        nearest_kernel = nearest_centers_avx2;
+        nearest_fixed_kernel = nearest_centers_fixed_avx2;
+        nearest_float_kernel = nearest_centers_float_avx2;
+        return KERNEL_AVX2;
+    }
+#endif
+
+    nearest_kernel = nearest_centers_scalar;
+    nearest_fixed_kernel = nearest_centers_fixed_scalar;
+    nearest_float_kernel = nearest_centers_float_scalar;
+    return KERNEL_SCALAR;
+}
+
+void nearest_centers(byte_t *data, double *centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane)
+{
+    nearest_kernel(data, centers, labels, dists, n_px, n_ch, n_clus, plane);
+}
+
+void quantize_centers(double *centers, short *fx_centers, int n_ch, int n_clus)
+{
+    int ch, k;
+
+    // Rounding the centers to fixed point, padded with zeros to four channels
+
+    for (k = 0; k < n_clus; k++) {
+        for (ch = 0; ch < DIST_MAX_CH; ch++) {
+            fx_centers[k * DIST_MAX_CH + ch] = ch < n_ch ? (short)(centers[k * n_ch + ch] * (1 << FIXED_BITS) + 0.5) : 0;
+        }
+    }
+}
+
+void nearest_centers_fixed(byte_t *data, short *fx_centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane)
+{
+    nearest_fixed_kernel(data, fx_centers, labels, dists, n_px, n_ch, n_clus, plane);
+}
+
+void convert_centers(double *centers, float *f_centers, int n_ch, int n_clus)
+{
+    int i;
+
+    for (i = 0; i < n_clus * n_ch; i++) {
+        f_centers[i] = (float)centers[i];
+    }
+}
+
+void nearest_centers_float(byte_t *data, float *f_centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane)
+{
+    nearest_float_kernel(data, f_centers, labels, dists, n_px, n_ch, n_clus, plane);
+}
+
+KERNEL_INLINE void nearest_centers_scalar_ch(byte_t *data, double *centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane)
+{
+    int px, ch, k;
+    int px_step, ch_step;
+    int min_k;
+    double dist, min_dist, tmp;
+
+    px_step = plane ? 1 : n_ch;
+    ch_step = plane ? plane : 1;
+
+    for (px = 0; px < n_px; px++) {
+        min_dist = DBL_MAX;
+        min_k = 0;
+
+        for (k = 0; k < n_clus; k++) {
+            dist = 0;
+
+            for (ch = 0; ch < n_ch; ch++) {
+                tmp = (double)(data[px * px_step + ch * ch_step] - centers[k * n_ch + ch]);
+                dist += tmp * tmp;
+            }
+
+            if (dist < min_dist) {
+                min_dist = dist;
+                min_k = k;
+            }
+        }
+
+        labels[px] = min_k;
+        dists[px] = min_dist;
+    }
+}
+
+void nearest_centers_scalar(byte_t *data, double *centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane)
+{
+    SPECIALIZE_CH(n_ch, nearest_centers_scalar_ch(data, centers, labels, dists, n_px, N_CH, n_clus, plane));
+}
+
+KERNEL_INLINE void pack_fixed(byte_t *data, int *pairs_lo, int *pairs_hi, int n_px, int n_ch, int px_step, int ch_step)
+{
+    int px, ch;
+    int val[DIST_MAX_CH];
+
+    // Packing the fixed-point channels of each pixel in two pairs of 16-bit
+    // values, so a multiply-add of the differences gives their squared sum
+
+    for (px = 0; px < n_px; px++) {
+        for (ch = 0; ch < DIST_MAX_CH; ch++) {
+            val[ch] = ch < n_ch ? data[px * px_step + ch * ch_step] << FIXED_BITS : 0;
+        }
+
+        pairs_lo[px] = val[0] | val[1] << 16;
+        pairs_hi[px] = val[2] | val[3] << 16;
+    }
+}
+
+KERNEL_INLINE void nearest_centers_fixed_scalar_ch(byte_t *data, short *fx_centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane)
+{
+    int px, ch, k;
+    int px_step, ch_step;
+    int min_k, dist, min_dist, tmp;
+
+    px_step = plane ? 1 : n_ch;
+    ch_step = plane ? plane : 1;
+
+    for (px = 0; px < n_px; px++) {
+        min_dist = INT_MAX;
+        min_k = 0;
+
+        for (k = 0; k < n_clus; k++) {
+            dist = 0;
+
+            for (ch = 0; ch < n_ch; ch++) {
+                tmp = (data[px * px_step + ch * ch_step] << FIXED_BITS) - fx_centers[k * DIST_MAX_CH + ch];
+                dist += tmp * tmp;
+            }
+
+            if (dist < min_dist) {
+                min_dist = dist;
+                min_k = k;
+            }
+        }
+
+        labels[px] = min_k;
+        dists[px] = (double)min_dist / (1 << 2 * FIXED_BITS);
+    }
+}
+
+void nearest_centers_fixed_scalar(byte_t *data, short *fx_centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane)
+{
+    SPECIALIZE_CH(n_ch, nearest_centers_fixed_scalar_ch(data, fx_centers, labels, dists, n_px, N_CH, n_clus, plane));
+}
+
+KERNEL_INLINE void nearest_centers_float_scalar_ch(byte_t *data, float *f_centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane)
+{
+    int px, ch, k;
+    int px_step, ch_step;
+    int min_k;
+    float dist, min_dist, tmp;
+
+    px_step = plane ? 1 : n_ch;
+    ch_step = plane ? plane : 1;
+
+    for (px = 0; px < n_px; px++) {
+        min_dist = FLT_MAX;
+        min_k = 0;
+
+        for (k = 0; k < n_clus; k++) {
+            dist = 0;
+
+            for (ch = 0; ch < n_ch; ch++) {
+                tmp = (float)data[px * px_step + ch * ch_step] - f_centers[k * n_ch + ch];
+                dist += tmp * tmp;
+            }
+
+            if (dist < min_dist) {
+                min_dist = dist;
+                min_k = k;
+            }
+        }
+
+        labels[px] = min_k;
+        dists[px] = min_dist;
+    }
+}
+
+void nearest_centers_float_scalar(byte_t *data, float *f_centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane)
+{
+    SPECIALIZE_CH(n_ch, nearest_centers_float_scalar_ch(data, f_centers, labels, dists, n_px, N_CH, n_clus, plane));
+}
+
+#ifdef DIST_X86
+
+// The vector kernels process one pixel per lane and perform the same
+// operations in the same order as the scalar one, without fused
+// multiply-add, so all the kernels give the same labels and distances
+
+__attribute__((target("avx2")))
+KERNEL_INLINE void nearest_centers_avx2_ch(byte_t *data, double *centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane)
+{
+    int px, ch, k;
+    int px_step, ch_step;
+    byte_t *src;
+    __m256d px_ch[DIST_MAX_CH];
+    __m256d dist, min_dist, min_k, tmp, mask;
+
+    px_step = plane ? 1 : n_ch;
+    ch_step = plane ? plane : 1;
+
+    if (n_ch > DIST_MAX_CH) {
+        nearest_centers_scalar_ch(data, centers, labels, dists, n_px, n_ch, n_clus, plane);
+        return;
+    }
+
+    for (px = 0; px + 4 <= n_px; px += 4) {
+        for (ch = 0; ch < n_ch; ch++) {
+            src = data + px * px_step + ch * ch_step;
+
+            // Planar channels are loaded with a single contiguous read
+
+            if (plane) {
+                px_ch[ch] = _mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_loadu_si32(src)));
+            } else {
+                px_ch[ch] = _mm256_cvtepi32_pd(_mm_setr_epi32(src[0], src[px_step], src[2 * px_step],
+                    src[3 * px_step]));
+            }
+        }
+
+        min_dist = _mm256_set1_pd(DBL_MAX);
+        min_k = _mm256_setzero_pd();
+
+        for (k = 0; k < n_clus; k++) {
+            dist = _mm256_setzero_pd();
+
+            for (ch = 0; ch < n_ch; ch++) {
+                tmp = _mm256_sub_pd(px_ch[ch], _mm256_broadcast_sd(centers + k * n_ch + ch));
+                dist = _mm256_add_pd(dist, _mm256_mul_pd(tmp, tmp));
+            }
+
+            mask = _mm256_cmp_pd(dist, min_dist, _CMP_LT_OQ);
+            min_dist = _mm256_blendv_pd(min_dist, dist, mask);
+            min_k = _mm256_blendv_pd(min_k, _mm256_set1_pd(k), mask);
+        }
+
+        _mm_storeu_si128((__m128i *)(labels + px), _mm256_cvtpd_epi32(min_k));
+        _mm256_storeu_pd(dists + px, min_dist);
+    }
+
+    nearest_centers_scalar_ch(data + px * px_step, centers, labels + px, dists + px, n_px - px, n_ch, n_clus, plane);
+}
+
+__attribute__((target("avx2")))
+void nearest_centers_avx2(byte_t *data, double *centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane)
+{
+    SPECIALIZE_CH(n_ch, nearest_centers_avx2_ch(data, centers, labels, dists, n_px, N_CH, n_clus, plane));
+}
+
+__attribute__((target("avx512f")))
+KERNEL_INLINE void nearest_centers_avx512_ch(byte_t *data, double *centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane)
+{
+    int px, ch, k;
+    int px_step, ch_step;
+    byte_t *src;
+    __mmask8 mask;
+    __m512d px_ch[DIST_MAX_CH];
+    __m512d dist, min_dist, min_k, tmp;
+
+    px_step = plane ? 1 : n_ch;
+    ch_step = plane ? plane : 1;
+
+    if (n_ch > DIST_MAX_CH) {
+        nearest_centers_scalar_ch(data, centers, labels, dists, n_px, n_ch, n_clus, plane);
+        return;
+    }
+
+    for (px = 0; px + 8 <= n_px; px += 8) {
+        for (ch = 0; ch < n_ch; ch++) {
+            src = data + px * px_step + ch * ch_step;
+
+            if (plane) {
+                px_ch[ch] = _mm512_cvtepi32_pd(_mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *)src)));
+            } else {
+                px_ch[ch] = _mm512_cvtepi32_pd(_mm256_setr_epi32(src[0], src[px_step], src[2 * px_step],
+                    src[3 * px_step], src[4 * px_step], src[5 * px_step], src[6 * px_step], src[7 * px_step]));
+            }
+        }
+
+        min_dist = _mm512_set1_pd(DBL_MAX);
+        min_k = _mm512_setzero_pd();
+
+        for (k = 0; k < n_clus; k++) {
+            dist = _mm512_setzero_pd();
+
+            for (ch = 0; ch < n_ch; ch++) {
+                tmp = _mm512_sub_pd(px_ch[ch], _mm512_set1_pd(centers[k * n_ch + ch]));
+                dist = _mm512_add_pd(dist, _mm512_mul_pd(tmp, tmp));
+            }
+
+            mask = _mm512_cmp_pd_mask(dist, min_dist, _CMP_LT_OQ);
+            min_dist = _mm512_mask_blend_pd(mask, min_dist, dist);
+            min_k = _mm512_mask_blend_pd(mask, min_k, _mm512_set1_pd(k));
+        }
+
+        _mm256_storeu_si256((__m256i *)(labels + px), _mm512_cvtpd_epi32(min_k));
+        _mm512_storeu_pd(dists + px, min_dist);
+    }
+
+    nearest_centers_scalar_ch(data + px * px_step, centers, labels + px, dists + px, n_px - px, n_ch, n_clus, plane);
+}
+
+__attribute__((target("avx512f")))
+void nearest_centers_avx512(byte_t *data, double *centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane)
+{
+    SPECIALIZE_CH(n_ch, nearest_centers_avx512_ch(data, centers, labels, dists, n_px, N_CH, n_clus, plane));
+}
+
+// The integer kernels are exact, so they all give the same labels as the
+// scalar one as well
+
+__attribute__((target("avx2")))
+KERNEL_INLINE void nearest_centers_fixed_avx2_ch(byte_t *data, short *fx_centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane)
+{
+    int px, i, k;
+    int px_step, ch_step;
+    int pairs_lo[8], pairs_hi[8], min_dists[8];
+    short *center;
+    __m256i px_lo, px_hi, dist, min_dist, min_k, tmp, mask;
+
+    px_step = plane ? 1 : n_ch;
+    ch_step = plane ? plane : 1;
+
+    if (n_ch > DIST_MAX_CH) {
+        nearest_centers_fixed_scalar_ch(data, fx_centers, labels, dists, n_px, n_ch, n_clus, plane);
+        return;
+    }
+
+    for (px = 0; px + 8 <= n_px; px += 8) {
+        pack_fixed(data + px * px_step, pairs_lo, pairs_hi, 8, n_ch, px_step, ch_step);
+        px_lo = _mm256_loadu_si256((__m256i *)pairs_lo);
+        px_hi = _mm256_loadu_si256((__m256i *)pairs_hi);
+
+        min_dist = _mm256_set1_epi32(INT_MAX);
+        min_k = _mm256_setzero_si256();
+
+        for (k = 0; k < n_clus; k++) {
+            center = fx_centers + k * DIST_MAX_CH;
+            tmp = _mm256_sub_epi16(px_lo, _mm256_set1_epi32((unsigned short)center[0] | center[1] << 16));
+            dist = _mm256_madd_epi16(tmp, tmp);
+
+            if (n_ch > 2) {
+                tmp = _mm256_sub_epi16(px_hi, _mm256_set1_epi32((unsigned short)center[2] | center[3] << 16));
+                dist = _mm256_add_epi32(dist, _mm256_madd_epi16(tmp, tmp));
+            }
+
+            mask = _mm256_cmpgt_epi32(min_dist, dist);
+            min_dist = _mm256_blendv_epi8(min_dist, dist, mask);
+            min_k = _mm256_blendv_epi8(min_k, _mm256_set1_epi32(k), mask);
+        }
+
+        _mm256_storeu_si256((__m256i *)(labels + px), min_k);
+        _mm256_storeu_si256((__m256i *)min_dists, min_dist);
+
+        for (i = 0; i < 8; i++) {
+            dists[px + i] = (double)min_dists[i] / (1 << 2 * FIXED_BITS);
+        }
+    }
+
+    nearest_centers_fixed_scalar_ch(data + px * px_step, fx_centers, labels + px, dists + px, n_px - px, n_ch, n_clus, plane);
+}
+
+__attribute__((target("avx2")))
+void nearest_centers_fixed_avx2(byte_t *data, short *fx_centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane)
+{
+    SPECIALIZE_CH(n_ch, nearest_centers_fixed_avx2_ch(data, fx_centers, labels, dists, n_px, N_CH, n_clus, plane));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+KERNEL_INLINE void nearest_centers_fixed_avx512_ch(byte_t *data, short *fx_centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane)
+{
+    int px, i, k;
+    int px_step, ch_step;
+    int pairs_lo[16], pairs_hi[16], min_dists[16];
+    short *center;
+    __mmask16 mask;
+    __m512i px_lo, px_hi, dist, min_dist, min_k, tmp;
+
+    px_step = plane ? 1 : n_ch;
+    ch_step = plane ? plane : 1;
+
+    if (n_ch > DIST_MAX_CH) {
+        nearest_centers_fixed_scalar_ch(data, fx_centers, labels, dists, n_px, n_ch, n_clus, plane);
+        return;
+    }
+
+    for (px = 0; px + 16 <= n_px; px += 16) {
+        pack_fixed(data + px * px_step, pairs_lo, pairs_hi, 16, n_ch, px_step, ch_step);
+        px_lo = _mm512_loadu_si512(pairs_lo);
+        px_hi = _mm512_loadu_si512(pairs_hi);
+
+        min_dist = _mm512_set1_epi32(INT_MAX);
+        min_k = _mm512_setzero_si512();
+
+        for (k = 0; k < n_clus; k++) {
+            center = fx_centers + k * DIST_MAX_CH;
+            tmp = _mm512_sub_epi16(px_lo, _mm512_set1_epi32((unsigned short)center[0] | center[1] << 16));
+            dist = _mm512_madd_epi16(tmp, tmp);
+
+            if (n_ch > 2) {
+                tmp = _mm512_sub_epi16(px_hi, _mm512_set1_epi32((unsigned short)center[2] | center[3] << 16));
+                dist = _mm512_add_epi32(dist, _mm512_madd_epi16(tmp, tmp));
+            }
+
+            mask = _mm512_cmpgt_epi32_mask(min_dist, dist);
+            min_dist = _mm512_mask_blend_epi32(mask, min_dist, dist);
+            min_k = _mm512_mask_blend_epi32(mask, min_k, _mm512_set1_epi32(k));
+        }
+
+        _mm512_storeu_si512(labels + px, min_k);
+        _mm512_storeu_si512(min_dists, min_dist);
+
+        for (i = 0; i < 16; i++) {
+            dists[px + i] = (double)min_dists[i] / (1 << 2 * FIXED_BITS);
+        }
+    }
+
+    nearest_centers_fixed_scalar_ch(data + px * px_step, fx_centers, labels + px, dists + px, n_px - px, n_ch, n_clus, plane);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+void nearest_centers_fixed_avx512(byte_t *data, short *fx_centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane)
+{
+    SPECIALIZE_CH(n_ch, nearest_centers_fixed_avx512_ch(data, fx_centers, labels, dists, n_px, N_CH, n_clus, plane));
+}
+
+__attribute__((target("avx2")))
+KERNEL_INLINE void nearest_centers_float_avx2_ch(byte_t *data, float *f_centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane)
+{
+    int px, ch, k;
+    int px_step, ch_step;
+    byte_t *src;
+    __m256 px_ch[DIST_MAX_CH];
+    __m256 dist, min_dist, min_k, tmp, mask;
+
+    px_step = plane ? 1 : n_ch;
+    ch_step = plane ? plane : 1;
+
+    if (n_ch > DIST_MAX_CH) {
+        nearest_centers_float_scalar_ch(data, f_centers, labels, dists, n_px, n_ch, n_clus, plane);
+        return;
+    }
+
+    for (px = 0; px + 8 <= n_px; px += 8) {
+        for (ch = 0; ch < n_ch; ch++) {
+            src = data + px * px_step + ch * ch_step;
+
+            if (plane) {
+                px_ch[ch] = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *)src)));
+            } else {
+                px_ch[ch] = _mm256_cvtepi32_ps(_mm256_setr_epi32(src[0], src[px_step], src[2 * px_step],
+                    src[3 * px_step], src[4 * px_step], src[5 * px_step], src[6 * px_step], src[7 * px_step]));
+            }
+        }
+
+        min_dist = _mm256_set1_ps(FLT_MAX);
+        min_k = _mm256_setzero_ps();
+
+        for (k = 0; k < n_clus; k++) {
+            dist = _mm256_setzero_ps();
+
+            for (ch = 0; ch < n_ch; ch++) {
+                tmp = _mm256_sub_ps(px_ch[ch], _mm256_broadcast_ss(f_centers + k * n_ch + ch));
+                dist = _mm256_add_ps(dist, _mm256_mul_ps(tmp, tmp));
+            }
+
+            mask = _mm256_cmp_ps(dist, min_dist, _CMP_LT_OQ);
+            min_dist = _mm256_blendv_ps(min_dist, dist, mask);
+            min_k = _mm256_blendv_ps(min_k, _mm256_set1_ps(k), mask);
+        }
+
+        _mm256_storeu_si256((__m256i *)(labels + px), _mm256_cvtps_epi32(min_k));
+        _mm256_storeu_pd(dists + px, _mm256_cvtps_pd(_mm256_castps256_ps128(min_dist)));
+        _mm256_storeu_pd(dists + px + 4, _mm256_cvtps_pd(_mm256_extractf128_ps(min_dist, 1)));
+    }
+
+    nearest_centers_float_scalar_ch(data + px * px_step, f_centers, labels + px, dists + px, n_px - px, n_ch, n_clus, plane);
+}
+
+__attribute__((target("avx2")))
+void nearest_centers_float_avx2(byte_t *data, float *f_centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane)
+{
+    SPECIALIZE_CH(n_ch, nearest_centers_float_avx2_ch(data, f_centers, labels, dists, n_px, N_CH, n_clus, plane));
+}
+
+__attribute__((target("avx512f")))
+KERNEL_INLINE void nearest_centers_float_avx512_ch(byte_t *data, float *f_centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane)
+{
+    int px, ch, k;
+    int px_step, ch_step;
+    byte_t *src;
+    __mmask16 mask;
+    __m512 px_ch[DIST_MAX_CH];
+    __m512 dist, min_dist, min_k, tmp;
+
+    px_step = plane ? 1 : n_ch;
+    ch_step = plane ? plane : 1;
+
+    if (n_ch > DIST_MAX_CH) {
+        nearest_centers_float_scalar_ch(data, f_centers, labels, dists, n_px, n_ch, n_clus, plane);
+        return;
+    }
+
+    for (px = 0; px + 16 <= n_px; px += 16) {
+        for (ch = 0; ch < n_ch; ch++) {
+            src = data + px * px_step + ch * ch_step;
+
+            if (plane) {
+                px_ch[ch] = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_loadu_si128((__m128i *)src)));
+            } else {
+                px_ch[ch] = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_setr_epi8(src[0], src[px_step],
+                    src[2 * px_step], src[3 * px_step], src[4 * px_step], src[5 * px_step], src[6 * px_step],
+                    src[7 * px_step], src[8 * px_step], src[9 * px_step], src[10 * px_step], src[11 * px_step],
+                    src[12 * px_step], src[13 * px_step], src[14 * px_step], src[15 * px_step])));
+            }
+        }
+
+        min_dist = _mm512_set1_ps(FLT_MAX);
+        min_k = _mm512_setzero_ps();
+
+        for (k = 0; k < n_clus; k++) {
+            dist = _mm512_setzero_ps();
+
+            for (ch = 0; ch < n_ch; ch++) {
+                tmp = _mm512_sub_ps(px_ch[ch], _mm512_set1_ps(f_centers[k * n_ch + ch]));
+                dist = _mm512_add_ps(dist, _mm512_mul_ps(tmp, tmp));
+            }
+
+            mask = _mm512_cmp_ps_mask(dist, min_dist, _CMP_LT_OQ);
+            min_dist = _mm512_mask_blend_ps(mask, min_dist, dist);
+            min_k = _mm512_mask_blend_ps(mask, min_k, _mm512_set1_ps(k));
+        }
+
+        _mm512_storeu_si512(labels + px, _mm512_cvtps_epi32(min_k));
+        _mm512_storeu_pd(dists + px, _mm512_cvtps_pd(_mm512_castps512_ps256(min_dist)));
+        _mm512_storeu_pd(dists + px + 8, _mm512_cvtps_pd(_mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(min_dist), 1))));
+    }
+
+    nearest_centers_float_scalar_ch(data + px * px_step, f_centers, labels + px, dists + px, n_px - px, n_ch, n_clus, plane);
+}
+
+__attribute__((target("avx512f")))
+void nearest_centers_float_avx512(byte_t *data, float *f_centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane)
+{
+    SPECIALIZE_CH(n_ch, nearest_centers_float_avx512_ch(data, f_centers, labels, dists, n_px, N_CH, n_clus, plane));
+}
+
+#else
+
+void nearest_centers_avx2(byte_t *data, double *centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane)
+{
+    nearest_centers_scalar(data, centers, labels, dists, n_px, n_ch, n_clus, plane);
+}
+
+void nearest_centers_avx512(byte_t *data, double *centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane)
+{
+    nearest_centers_scalar(data, centers, labels, dists, n_px, n_ch, n_clus, plane);
+}
+
+void nearest_centers_fixed_avx2(byte_t *data, short *fx_centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane)
+{
+    nearest_centers_fixed_scalar(data, fx_centers, labels, dists, n_px, n_ch, n_clus, plane);
+}
+
+void nearest_centers_fixed_avx512(byte_t *data, short *fx_centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane)
+{
+    nearest_centers_fixed_scalar(data, fx_centers, labels, dists, n_px, n_ch, n_clus, plane);
+}
+
+void nearest_centers_float_avx2(byte_t *data, float *f_centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane)
+{
+    nearest_centers_float_scalar(data, f_centers, labels, dists, n_px, n_ch, n_clus, plane);
+}
+
+void nearest_centers_float_avx512(byte_t *data, float *f_centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane)
+{
+    nearest_centers_float_scalar(data, f_centers, labels, dists, n_px, n_ch, n_clus, plane);
+}
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef DISTANCE_H
+#define DISTANCE_H
+
+// Kernels available for the computation of the pixel-center distances
+
+#define KERNEL_SCALAR 0
+#define KERNEL_AVX2 1
+#define KERNEL_AVX512 2
+
+// Pixels handed to the kernel at each call by the assignment
+
+#define DIST_BLOCK 256
+
+// Channels held by the vector kernels and by the fixed-point centers
+
+#define DIST_MAX_CH 4
+
+// Fractional bits of the fixed-point centers. Pixels take 8 + 6 bits, so the
+// squared distance over four channels always fits a signed 32-bit integer
+
+#define FIXED_BITS 6
+
+// Expanding a call once for each common number of channels, with N_CH as a
+// constant, so that the inlined kernel has its loops over the channels unrolled
+
+#define KERNEL_INLINE inline __attribute__((always_inline))
+
+#define SPECIALIZE_CH(n_ch, call) \
+    switch (n_ch) { \
+        case 1: { const int N_CH = 1; call; break; } \
+        case 2: { const int N_CH = 2; call; break; } \
+        case 3: { const int N_CH = 3; call; break; } \
+        case 4: { const int N_CH = 4; call; break; } \
+        default: { const int N_CH = n_ch; call; break; } \
+    }
+
+// The kernels read pixels either interleaved, with plane = 0, or stored as one
+// plane per channel, with the channels of a pixel plane values apart
+
+int select_dist_kernel();
+void nearest_centers(byte_t *data, double *centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane);
+void quantize_centers(double *centers, short *fx_centers, int n_ch, int n_clus);
+void nearest_centers_fixed(byte_t *data, short *fx_centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane);
+void convert_centers(double *centers, float *f_centers, int n_ch, int n_clus);
+void nearest_centers_float(byte_t *data, float *f_centers, int *labels, double *dists, int n_px, int n_ch, int n_clus, int plane);
+
+#endif
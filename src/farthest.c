@@ -0,0 +1,104 @@
+#include "farthest.h"
+
+int far_before(double dist_a, int idx_a, double dist_b, int idx_b);
+void far_swap(double *far_dists, int *far_idx, int a, int b);
+void far_sift_down(double *far_dists, int *far_idx, int i, int n_far);
+
+// A pixel comes before another if it is farther from its center, or as far
+// and with a lower index, which is the order of the repair of empty clusters
+
+int far_before(double dist_a, int idx_a, double dist_b, int idx_b)
+{
+    return dist_a > dist_b || (dist_a == dist_b && idx_a < idx_b);
+}
+
+void far_swap(double *far_dists, int *far_idx, int a, int b)
+{
+    double tmp_dist;
+    int tmp_idx;
+
+    tmp_dist = far_dists[a];
+    far_dists[a] = far_dists[b];
+    far_dists[b] = tmp_dist;
+
+    tmp_idx = far_idx[a];
+    far_idx[a] = far_idx[b];
+    far_idx[b] = tmp_idx;
+}
+
+void far_sift_down(double *far_dists, int *far_idx, int i, int n_far)
+{
+    int child;
+
+    // The root holds the pixel that comes last, so each node moves below the
+    // child that comes after it
+
+    while ((child = 2 * i + 1) < n_far) {
+        if (child + 1 < n_far && far_before(far_dists[child], far_idx[child], far_dists[child + 1], far_idx[child + 1])) {
+            child++;
+        }
+
+        if (!far_before(far_dists[i], far_idx[i], far_dists[child], far_idx[child])) {
+            break;
+        }
+
+        far_swap(far_dists, far_idx, i, child);
+        i = child;
+    }
+}
+
+int far_push(double *far_dists, int *far_idx, int n_far, int max_far, double dist, int idx)
+{
+    int i, parent;
+
+    if (dist <= 0) {
+        return n_far;
+    }
+
+    if (n_far < max_far) {
+        i = n_far++;
+        far_dists[i] = dist;
+        far_idx[i] = idx;
+
+        while (i > 0) {
+            parent = (i - 1) / 2;
+
+            if (!far_before(far_dists[parent], far_idx[parent], far_dists[i], far_idx[i])) {
+                break;
+            }
+
+            far_swap(far_dists, far_idx, i, parent);
+            i = parent;
+        }
+    } else if (far_before(dist, idx, far_dists[0], far_idx[0])) {
+        far_dists[0] = dist;
+        far_idx[0] = idx;
+        far_sift_down(far_dists, far_idx, 0, n_far);
+    }
+
+    return n_far;
+}
+
+int far_merge(double *far_dists, int *far_idx, int n_far, double *src_dists, int *src_idx, int n_src, int max_far)
+{
+    int i;
+
+    for (i = 0; i < n_src; i++) {
+        n_far = far_push(far_dists, far_idx, n_far, max_far, src_dists[i], src_idx[i]);
+    }
+
+    return n_far;
+}
+
+void far_sort(double *far_dists, int *far_idx, int n_far)
+{
+    int n;
+
+    // Moving the pixel that comes last to the end of the heap until it is
+    // empty, which leaves the pixels in the order of the repair
+
+    for (n = n_far - 1; n > 0; n--) {
+        far_swap(far_dists, far_idx, 0, n);
+        far_sift_down(far_dists, far_idx, 0, n);
+    }
+}
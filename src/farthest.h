@@ -0,0 +1,16 @@
+#ifndef FARTHEST_H
+#define FARTHEST_H
+
+// The pixels farthest from their centers are kept in a min-heap of bounded
+// size, ordered by distance and then by index, so that the pixels kept do not
+// depend on the order of the pushes, nor on how the pushes are split among
+// threads and merged. Only pixels at a positive distance are kept
+
+#define FAR_KEEPS(far_dists, n_far, max_far, dist) \
+    ((dist) > 0 && ((n_far) < (max_far) || (dist) >= (far_dists)[0]))
+
+int far_push(double *far_dists, int *far_idx, int n_far, int max_far, double dist, int idx);
+int far_merge(double *far_dists, int *far_idx, int n_far, double *src_dists, int *src_idx, int n_src, int max_far);
+void far_sort(double *far_dists, int *far_idx, int n_far);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef LABELS_H
+#define LABELS_H
+
+// Labels are stored in the narrowest unsigned type that holds all the
+// clusters plus the all-ones value, which marks the points not assigned yet
+
+#define LABEL_SIZE(n_clus) ((n_clus) < 0xff ? 1 : (n_clus) < 0xffff ? 2 : 4)
+#define LABEL_NONE 0xff
+
+#define GET_LABEL(labels, px, size) \
+    ((size) == 1 ? ((unsigned char *)(labels))[px] : \
+     (size) == 2 ? ((unsigned short *)(labels))[px] : ((int *)(labels))[px])
+
+#define SET_LABEL(labels, px, size, k) \
+    do { \
+        if ((size) == 1) { \
+            ((unsigned char *)(labels))[px] = (k); \
+        } else if ((size) == 2) { \
+            ((unsigned short *)(labels))[px] = (k); \
+        } else { \
+            ((int *)(labels))[px] = (k); \
+        } \
+    } while (0)
+
+// Expanding a call once for each label size, with L_SIZE as a constant, so
+// that the accesses of the inlined kernel compile to plain loads and stores
+
+#define SPECIALIZE_LABELS(size, call) \
+    switch (size) { \
+        case 1: { const int L_SIZE = 1; call; break; } \
+        case 2: { const int L_SIZE = 2; call; break; } \
+        default: { const int L_SIZE = 4; call; break; } \
+    }
+
+#endif
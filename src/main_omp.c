@@ -1,53 +1,149 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <string.h>
 #include <time.h>
 #include <sys/time.h>
 #include <omp.h>
 
 #include "image_io.h"
+#include "distance.h"
 #include "segmentation.h"
 
 #define DEFAULT_N_CLUSTS 4
 #define DEFAULT_MAX_ITERS 150
+#define DEFAULT_ALGO ALGO_LLOYD
+#define DEFAULT_INIT INIT_RANDOM
+#define DEFAULT_REDUCE REDUCE_NONE
+#define DEFAULT_HIST_BITS 5
+#define DEFAULT_BATCH_SIZE 1024
+#define DEFAULT_PRECISION PREC_DOUBLE
+#define DEFAULT_LAYOUT LAYOUT_INTERLEAVED
+#define DEFAULT_REPAIR REPAIR_HEAP
+#define DEFAULT_UPDATE UPDATE_FULL
+#define DEFAULT_TOL_CHANGES 0.0
+#define DEFAULT_TOL_SSE 0.0
+#define DEFAULT_TOL_SHIFT 0.0
+#define DEFAULT_DEADLINE 0.0
+#define DEFAULT_PLACEMENT PLACE_DEFAULT
+#define DEFAULT_PIN PIN_NONE
 #define DEFAULT_N_THREADS 2
 #define DEFAULT_OUT_PATH "result.jpg"
 
+char *algo_names[] = {"lloyd", "elkan", "hamerly", "yinyang", "minibatch"};
+char *init_names[] = {"random", "kmeans++", "kmeans||"};
+char *reduce_names[] = {"none", "unique", "hist"};
+char *precision_names[] = {"double", "fixed", "float"};
+char *layout_names[] = {"interleaved", "planar"};
+char *repair_names[] = {"scan", "heap"};
+char *update_names[] = {"full", "incremental"};
+char *placement_names[] = {"default", "numa"};
+char *pin_names[] = {"none", "close", "spread"};
+char *stop_names[] = {"max iters", "converged", "changes", "sse", "shift", "deadline"};
+char *kernel_names[] = {"scalar", "avx2", "avx512"};
+
 double get_time();
+int parse_name(char *name, char **names, int n_names);
 void print_usage(char *pgr_name);
-void print_exec(int width, int height, int n_ch, int n_clus, int n_threads, int n_iters, double sse, double exec_time);
+void print_exec(int width, int height, int n_ch, int n_clus, int n_threads, int n_iters, double sse, double ref_sse, int ref_iters, double exec_time, segm_params_t *params);
 
 int main(int argc, char **argv)
 {
     char *in_path = NULL;
     char *out_path = DEFAULT_OUT_PATH;
-    byte_t *data;
+    byte_t *data, *ref_data = NULL;
     int width, height, n_ch;
     int n_clus = DEFAULT_N_CLUSTS;
     int n_iters = DEFAULT_MAX_ITERS;
     int n_threads = DEFAULT_N_THREADS;
     int seed = time(NULL);
-    double sse, start_time, exec_time;
+    int ref_iters = 0, verify = 0;
+    double sse, ref_sse = 0, start_time, exec_time;
+    segm_params_t params = {
+        .algo = DEFAULT_ALGO,
+        .init = DEFAULT_INIT,
+        .reduce = DEFAULT_REDUCE,
+        .hist_bits = DEFAULT_HIST_BITS,
+        .batch_size = DEFAULT_BATCH_SIZE,
+        .precision = DEFAULT_PRECISION,
+        .layout = DEFAULT_LAYOUT,
+        .repair = DEFAULT_REPAIR,
+        .update = DEFAULT_UPDATE,
+        .tol_changes = DEFAULT_TOL_CHANGES,
+        .tol_sse = DEFAULT_TOL_SSE,
+        .tol_shift = DEFAULT_TOL_SHIFT,
+        .deadline = DEFAULT_DEADLINE,
+        .placement = DEFAULT_PLACEMENT,
+        .pin = DEFAULT_PIN
+    };
 
     // Parsing arguments and optional parameters
 
     char optchar;
-    while ((optchar = getopt(argc, argv, "k:m:o:s:t:h")) != -1) {
+    while ((optchar = getopt(argc, argv, "a:b:c:d:e:f:i:k:l:m:n:o:p:q:r:s:t:u:vw:x:h")) != -1) {
         switch (optchar) {
+            case 'a':
+                params.algo = parse_name(optarg, algo_names, sizeof(algo_names) / sizeof(char *));
+                break;
+            case 'r':
+                params.reduce = parse_name(optarg, reduce_names, sizeof(reduce_names) / sizeof(char *));
+                break;
+            case 'b':
+                params.hist_bits = strtol(optarg, NULL, 10);
+                break;
+            case 'c':
+                params.update = parse_name(optarg, update_names, sizeof(update_names) / sizeof(char *));
+                break;
+            case 'd':
+                params.precision = parse_name(optarg, precision_names, sizeof(precision_names) / sizeof(char *));
+                break;
+            case 'e':
+                params.repair = parse_name(optarg, repair_names, sizeof(repair_names) / sizeof(char *));
+                break;
+            case 'f':
+                params.tol_changes = strtod(optarg, NULL);
+                break;
+            case 'q':
+                params.tol_sse = strtod(optarg, NULL);
+                break;
+            case 'v':
+                verify = 1;
+                break;
+            case 'w':
+                params.deadline = strtod(optarg, NULL);
+                break;
+            case 'x':
+                params.tol_shift = strtod(optarg, NULL);
+                break;
+            case 'i':
+                params.init = parse_name(optarg, init_names, sizeof(init_names) / sizeof(char *));
+                break;
             case 'k':
                 n_clus = strtol(optarg, NULL, 10);
                 break;
+            case 'l':
+                params.layout = parse_name(optarg, layout_names, sizeof(layout_names) / sizeof(char *));
+                break;
             case 'm':
                 n_iters = strtol(optarg, NULL, 10);
                 break;
+            case 'n':
+                params.batch_size = strtol(optarg, NULL, 10);
+                break;
             case 'o':
                 out_path = optarg;
                 break;
+            case 'p':
+                params.pin = parse_name(optarg, pin_names, sizeof(pin_names) / sizeof(char *));
+                break;
             case 's':
                 seed = strtol(optarg, NULL, 10);
                 break;
             case 't':
-                n_threads = strtol(optarg, NULL, 10);
+                n_threads = strcmp(optarg, "auto") == 0 ? THREADS_AUTO : strtol(optarg, NULL, 10);
+                break;
+            case 'u':
+                params.placement = parse_name(optarg, placement_names, sizeof(placement_names) / sizeof(char *));
                 break;
             case 'h':
             default:
@@ -66,6 +162,81 @@ int main(int argc, char **argv)
         exit(EXIT_FAILURE);
     }
 
+    if (params.algo < 0) {
+        fprintf(stderr, "INPUT ERROR: << Invalid algorithm >> \n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (params.init < 0) {
+        fprintf(stderr, "INPUT ERROR: << Invalid initialization >> \n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (params.batch_size < 1) {
+        fprintf(stderr, "INPUT ERROR: << Invalid batch size >> \n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (params.precision < 0) {
+        fprintf(stderr, "INPUT ERROR: << Invalid precision >> \n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (params.layout < 0) {
+        fprintf(stderr, "INPUT ERROR: << Invalid layout >> \n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (params.update < 0) {
+        fprintf(stderr, "INPUT ERROR: << Invalid update >> \n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (params.repair < 0) {
+        fprintf(stderr, "INPUT ERROR: << Invalid repair >> \n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (params.placement < 0) {
+        fprintf(stderr, "INPUT ERROR: << Invalid placement >> \n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (params.pin < 0) {
+        fprintf(stderr, "INPUT ERROR: << Invalid pinning >> \n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (params.tol_changes < 0 || params.tol_changes > 1) {
+        fprintf(stderr, "INPUT ERROR: << Invalid tolerance on the changed pixels >> \n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (params.tol_sse < 0) {
+        fprintf(stderr, "INPUT ERROR: << Invalid tolerance on the SSE >> \n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (params.tol_shift < 0) {
+        fprintf(stderr, "INPUT ERROR: << Invalid tolerance on the center shift >> \n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (params.deadline < 0) {
+        fprintf(stderr, "INPUT ERROR: << Invalid time budget >> \n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (params.reduce < 0) {
+        fprintf(stderr, "INPUT ERROR: << Invalid reduction >> \n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (params.hist_bits < 1 || params.hist_bits > 6) {
+        fprintf(stderr, "INPUT ERROR: << Invalid number of histogram bits >> \n");
+        exit(EXIT_FAILURE);
+    }
+
     if (n_clus < 2) {
         fprintf(stderr, "INPUT ERROR: << Invalid number of clusters >> \n");
         exit(EXIT_FAILURE);
@@ -76,27 +247,47 @@ int main(int argc, char **argv)
         exit(EXIT_FAILURE);
     }
 
-    if (n_threads < 2) {
+    if (n_threads < 1 && n_threads != THREADS_AUTO) {
         fprintf(stderr, "INPUT ERROR: << Invalid number of threads >> \n");
         exit(EXIT_FAILURE);
     }
 
-    srand(seed);
+    params.seed = seed;
 
     // Scanning input image
 
     data = img_load(in_path, &width, &height, &n_ch);
 
+    // Keeping a copy of the image to compare a reduced precision run with a
+    // double precision one, only on request as it doubles the work
+
+    if (verify && params.precision != PREC_DOUBLE) {
+        ref_data = malloc(width * height * n_ch * sizeof(byte_t));
+        memcpy(ref_data, data, width * height * n_ch * sizeof(byte_t));
+        ref_iters = n_iters;
+    }
+
     // Executing k-means segmentation
 
     start_time = get_time();
-    kmeans_segm_omp(data, width, height, n_ch, n_clus, &n_iters, &sse, n_threads);
+    kmeans_segm_omp(data, width, height, n_ch, n_clus, &n_iters, &sse, n_threads, &params);
     exec_time = get_time() - start_time;
 
+    if (ref_data) {
+        segm_params_t ref_params = params;
+
+        // The double run only differs in precision, with the same seed and
+        // stop criteria, so that the SSE gap measures the cost of the precision
+
+        ref_params.precision = PREC_DOUBLE;
+        kmeans_segm_omp(ref_data, width, height, n_ch, n_clus, &ref_iters, &ref_sse, params.n_threads, &ref_params);
+        free(ref_data);
+    }
+
     // Saving and printing results
 
     img_save(out_path, data, width, height, n_ch);
-    print_exec(width, height, n_ch, n_clus, n_threads, n_iters, sse, exec_time);
+    print_exec(width, height, n_ch, n_clus, params.n_threads, n_iters, sse, ref_sse, ref_iters, exec_time, &params);
 
     free(data);
 
@@ -112,11 +303,28 @@ double get_time()
     return timecheck.tv_sec + timecheck.tv_usec / 1000000.0;
 }
 
+int parse_name(char *name, char **names, int n_names)
+{
+    int i;
+
+    for (i = 0; i < n_names; i++) {
+        if (strcmp(name, names[i]) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
 void print_usage(char *pgr_name)
 {
     char *usage = "PROGRAM USAGE \n\n"
-        "   %s [-h] [-k num_clusters] [-m max_iters] [-o output_img] \n"
-        "             [-s seed] [-t num_threads] input_image \n\n"
+        "   %s [-h] [-a algorithm] [-b hist_bits] [-c update] [-d precision] \n"
+        "             [-e repair] [-f change_tol] [-i init] [-k num_clusters] \n"
+        "             [-l layout] [-m max_iters] [-n batch_size] [-o output_img] \n"
+        "             [-p pinning] [-q sse_tol] [-r reduction] [-s seed] \n"
+        "             [-t num_threads] [-u placement] [-v] [-w time_budget] \n"
+        "             [-x shift_tol] input_image \n\n"
         "   The input image filepath is the only mandatory argument and \n"
         "   must be specified last, after all the optional parameters. \n"
         "   Valid input image formats are JPEG, PNG, BMP, GIF, TGA, PSD, \n"
@@ -124,36 +332,165 @@ void print_usage(char *pgr_name)
         "   of the input image using a parallel version the k-means \n"
         "   clustering algorithm implemented via OpenMP. \n\n"
         "OPTIONAL PARAMETERS \n\n"
+        "   -a algorithm    : algorithm used to assign the pixels to the clusters. \n"
+        "                     Valid values are lloyd (all the distances are \n"
+        "                     computed at each iteration), elkan (distances \n"
+        "                     are skipped using triangle inequality bounds, \n"
+        "                     requires memory for num_clusters bounds per \n"
+        "                     pixel), hamerly (like elkan, but keeping only \n"
+        "                     two bounds per pixel), yinyang (one bound per \n"
+        "                     group of ten centers, suited for many clusters) \n"
+        "                     and minibatch (approximate, each iteration moves \n"
+        "                     the centers using a random sample of pixels). \n"
+        "                     Default is %s. \n"
+        "   -b hist_bits    : bits per channel of the bins of the hist reduction. \n"
+        "                     Must be between 1 and 6. Default is %d. \n"
+        "   -c update       : computation of the center sums at each iteration of \n"
+        "                     the lloyd, elkan, hamerly and yinyang algorithms. \n"
+        "                     Valid values are full (the sums are accumulated \n"
+        "                     from all the pixels) and incremental (the sums of \n"
+        "                     the previous iteration are kept, and only the \n"
+        "                     pixels changing cluster are moved from the sums \n"
+        "                     of the old center to the new one, which makes \n"
+        "                     the late iterations cheaper). Both give the same \n"
+        "                     result. Default is %s. \n"
+        "   -d precision    : arithmetic of the distances computed by the lloyd \n"
+        "                     and minibatch algorithms. Valid values are \n"
+        "                     double, fixed (approximate, the centers are \n"
+        "                     rounded to 16-bit fixed point and the distances \n"
+        "                     are computed with integers, which fit more pixels \n"
+        "                     in each vector) and float (approximate, single \n"
+        "                     precision distances). With fixed and float, -v \n"
+        "                     also reports the SSE difference from a double \n"
+        "                     precision run. Default is %s. \n"
+        "   -e repair       : source of the pixels moved to the empty clusters by \n"
+        "                     the lloyd algorithm, which takes the farthest \n"
+        "                     pixels from their centers. Valid values are scan \n"
+        "                     (the distances of all the pixels are stored and \n"
+        "                     scanned) and heap (the assignment only keeps the \n"
+        "                     farthest pixels, saving the memory traffic of the \n"
+        "                     distances). Both give the same result, and the \n"
+        "                     bounded algorithms always scan. Default is %s. \n"
+        "   -f change_tol   : stop the lloyd, elkan, hamerly and yinyang algorithms \n"
+        "                     when at most this fraction of the pixels changes \n"
+        "                     cluster in an iteration. Must be between 0 and 1, \n"
+        "                     0 stops only when no pixel changes. Default is %g. \n"
+        "   -i init         : method used to select the initial centers. Valid \n"
+        "                     values are random (pixels chosen uniformly), \n"
+        "                     kmeans++ (pixels chosen with probability \n"
+        "                     proportional to their squared distance from the \n"
+        "                     centers already selected) and kmeans|| (a few \n"
+        "                     rounds of oversampling followed by the \n"
+        "                     reclustering of the sampled pixels, faster for \n"
+        "                     many clusters). Default is %s. \n"
         "   -k num_clusters : number of clusters to use for the segmentation of \n"
         "                     the image. Must be bigger than 1. Default is %d. \n"
+        "   -l layout       : layout of the pixels read by the lloyd and minibatch \n"
+        "                     algorithms. Valid values are interleaved (the \n"
+        "                     channels of each pixel are contiguous, as loaded) \n"
+        "                     and planar (the image is copied once into one \n"
+        "                     plane per channel, so that the vector kernels \n"
+        "                     read contiguous pixels). Default is %s. \n"
         "   -m max_iters    : maximum number of iterations that the clustering \n"
         "                     algorithm can perform before being forced to stop. \n"
         "                     Must be bigger that 0. Default is %d. \n"
+        "   -n batch_size   : number of pixels sampled at each iteration of the \n"
+        "                     minibatch algorithm. Must be bigger than 0. \n"
+        "                     Default is %d. \n"
         "   -o output_image : filepath of the output image. Valid output image \n"
         "                     formats are JPEG, PNG, BMP and TGA. If not specified, \n"
         "                     the resulting image will be saved in the current \n"
         "                     directory using JPEG format. \n"
+        "   -p pinning      : binding of the threads to the CPUs. Valid values \n"
+        "                     are none (the threads are left to the scheduler), \n"
+        "                     close (each thread is bound to the next CPU) and \n"
+        "                     spread (the threads are bound to CPUs spaced \n"
+        "                     evenly, which uses all the sockets of a \n"
+        "                     multi-socket machine). Default is %s. \n"
+        "   -q sse_tol      : stop the lloyd, elkan, hamerly and yinyang algorithms \n"
+        "                     when an iteration decreases the SSE by at most this \n"
+        "                     fraction of its previous value. Must not be \n"
+        "                     negative, 0 disables the check. Default is %g. \n"
+        "   -r reduction    : reduction of the pixels applied before the clustering. \n"
+        "                     Valid values are none, unique (the clustering \n"
+        "                     runs on the table of the distinct colors, weighted \n"
+        "                     by their number of pixels) and hist (approximate, \n"
+        "                     the clustering runs on the centroids of the bins \n"
+        "                     of a color histogram). Default is %s. \n"
         "   -s seed         : seed to use for the random selection of the initial \n"
-        "                     centers. The clustering algorithm will always use  \n"
-        "                     the same set of initial centers if the same \n"
-        "                     seed is specified. \n"
+        "                     centers and of the mini-batches. The clustering \n"
+        "                     algorithm will always give the same result if the \n"
+        "                     same seed is specified, for both the serial and the \n"
+        "                     parallel program and any number of threads. \n"
         "   -t num_threads  : number of threads to use for the clustering algorithm. \n"
-        "                     Must be bigger than 1. Default is %d. \n"
+        "                     Must be bigger than 0, or auto to choose it from \n"
+        "                     the size of the work and a short calibration run \n"
+        "                     of the assignment, whose result is cached for the \n"
+        "                     host in ~/.segm_threads. Default is %d. \n"
+        "   -u placement    : placement of the buffers of the points in memory. \n"
+        "                     Valid values are default (the image stays where \n"
+        "                     it was loaded) and numa (the points, labels and \n"
+        "                     distances are copied or first written by the \n"
+        "                     threads that assign them, so that on multi-socket \n"
+        "                     machines each thread reads its points from its \n"
+        "                     own memory node; best combined with -p). Default \n"
+        "                     is %s. \n"
+        "   -v              : with the fixed and float precisions, also cluster \n"
+        "                     the image in double precision to report the SSE \n"
+        "                     difference. The double run only differs in \n"
+        "                     precision, with the same seed and stop criteria, \n"
+        "                     and doubles the time and the memory of the image. \n"
+        "   -w time_budget  : maximum time in seconds of the clustering. The \n"
+        "                     iterations stop early when the next one, timed \n"
+        "                     as the last one, would not leave the time to \n"
+        "                     write the result, which is then the one of the \n"
+        "                     last iteration completed. At least one iteration \n"
+        "                     is always run. 0 disables the budget. \n"
+        "                     Default is %g. \n"
+        "   -x shift_tol    : stop when no center moves by more than this distance \n"
+        "                     in an iteration, for all the algorithms. Must not \n"
+        "                     be negative, 0 disables the check. Default is %g. \n"
         "   -h              : print usage information. \n";
 
-    fprintf(stderr, usage, pgr_name, DEFAULT_N_CLUSTS, DEFAULT_MAX_ITERS, DEFAULT_N_THREADS);
+    fprintf(stderr, usage, pgr_name, algo_names[DEFAULT_ALGO], DEFAULT_HIST_BITS, update_names[DEFAULT_UPDATE], precision_names[DEFAULT_PRECISION],
+        repair_names[DEFAULT_REPAIR], DEFAULT_TOL_CHANGES, init_names[DEFAULT_INIT], DEFAULT_N_CLUSTS, layout_names[DEFAULT_LAYOUT], DEFAULT_MAX_ITERS,
+        DEFAULT_BATCH_SIZE, pin_names[DEFAULT_PIN], DEFAULT_TOL_SSE, reduce_names[DEFAULT_REDUCE], DEFAULT_N_THREADS,
+        placement_names[DEFAULT_PLACEMENT], DEFAULT_DEADLINE, DEFAULT_TOL_SHIFT);
 }
 
-void print_exec(int width, int height, int n_ch, int n_clus, int n_threads, int n_iters, double sse, double exec_time)
+void print_exec(int width, int height, int n_ch, int n_clus, int n_threads, int n_iters, double sse, double ref_sse, int ref_iters, double exec_time, segm_params_t *params)
 {
     char *details = "\nEXECUTION DETAILS\n\n"
+        "  Algorithm              : %s\n"
+        "  Initialization         : %s\n"
+        "  Reduction              : %s\n"
+        "  Precision              : %s\n"
+        "  Layout                 : %s\n"
+        "  Empty cluster repair   : %s\n"
+        "  Center update          : %s\n"
+        "  Distance kernel        : %s\n"
+        "  Memory placement       : %s\n"
+        "  Thread pinning         : %s\n"
         "  Image size             : %d x %d\n"
         "  Color channels         : %d\n"
+        "  Clustered points       : %d\n"
         "  Number of clusters     : %d\n"
         "  Number of threads      : %d\n"
         "  Number of iterations   : %d\n"
+        "  Stop criterion         : %s\n"
+        "  Distances computed     : %lld\n"
+        "  Distances skipped      : %lld (%.2f%%)\n"
         "  Sum of squared errors  : %f\n"
-        "  Execution time         : %f\n\n";
+        "  Execution time         : %f\n";
+
+    fprintf(stdout, details, algo_names[params->algo], init_names[params->init], reduce_names[params->reduce],
+        precision_names[params->precision], layout_names[params->layout], repair_names[params->repair], update_names[params->update],
+        kernel_names[params->kernel], placement_names[params->placement], pin_names[params->pin], width, height, n_ch, params->n_points, n_clus, n_threads, n_iters, stop_names[params->stop], params->n_dists, params->n_skipped,
+        100.0 * params->n_skipped / (params->n_dists + params->n_skipped), sse, exec_time);
+
+    if (ref_iters) {
+        fprintf(stdout, "  SSE of double run      : %f (%+.4f%%, %d iterations)\n", ref_sse, 100.0 * (sse - ref_sse) / ref_sse, ref_iters);
+    }
 
-    fprintf(stdout, details, width, height, n_ch, n_clus, n_threads, n_iters, sse, exec_time);
+    fprintf(stdout, "\n");
 }
@@ -0,0 +1,38 @@
+#include "random.h"
+
+#define PHILOX_M 0xD256D193U
+#define PHILOX_W 0x9E3779B9U
+#define PHILOX_ROUNDS 10
+
+// Counter-based generator (Philox-2x32-10): each draw is a function of the
+// seed and of its position only, so it can be computed by any thread in any
+// order and still give the same sequence as the serial program
+
+unsigned long long rand_u64(unsigned int seed, unsigned int stream, unsigned int index)
+{
+    int r;
+    unsigned int hi, lo;
+    unsigned long long prod;
+
+    hi = index;
+    lo = stream;
+
+    for (r = 0; r < PHILOX_ROUNDS; r++) {
+        prod = (unsigned long long)PHILOX_M * hi;
+        hi = (unsigned int)(prod >> 32) ^ seed ^ lo;
+        lo = (unsigned int)prod;
+        seed += PHILOX_W;
+    }
+
+    return (unsigned long long)hi << 32 | lo;
+}
+
+double rand_unit(unsigned int seed, unsigned int stream, unsigned int index)
+{
+    return (rand_u64(seed, stream, index) >> 11) * 0x1.0p-53;
+}
+
+int rand_index(unsigned int seed, unsigned int stream, unsigned int index, int n)
+{
+    return rand_u64(seed, stream, index) % n;
+}
@@ -0,0 +1,15 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+
+// Streams of the draws used by the different random steps
+
+#define RNG_INIT (0 << 24)
+#define RNG_KMEANSPP (1 << 24)
+#define RNG_KMEANSPAR (2 << 24)
+#define RNG_MINIBATCH (3 << 24)
+
+unsigned long long rand_u64(unsigned int seed, unsigned int stream, unsigned int index);
+double rand_unit(unsigned int seed, unsigned int stream, unsigned int index);
+int rand_index(unsigned int seed, unsigned int stream, unsigned int index, int n);
+
+#endif
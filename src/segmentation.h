@@ -1,7 +1,98 @@
 #ifndef SEGMENTATION_H
 #define SEGMENTATION_H
 
-void kmeans_segm(byte_t *data, int width, int height, int n_ch, int n_clus, int *n_iters, double *sse);
-void kmeans_segm_omp(byte_t *data, int width, int height, int n_ch, int n_clus, int *n_iters, double *sse, int n_threads);
+// Algorithms available for the assignment of the pixels to the clusters
+
+#define ALGO_LLOYD 0
+#define ALGO_ELKAN 1
+#define ALGO_HAMERLY 2
+#define ALGO_YINYANG 3
+#define ALGO_MINIBATCH 4
+
+// Methods available for the selection of the initial centers
+
+#define INIT_RANDOM 0
+#define INIT_KMEANSPP 1
+#define INIT_KMEANSPAR 2
+
+// Reductions of the pixels applied before the clustering
+
+#define REDUCE_NONE 0
+#define REDUCE_UNIQUE 1
+#define REDUCE_HIST 2
+
+// Arithmetic used by the distance kernels of the assignment
+
+#define PREC_DOUBLE 0
+#define PREC_FIXED 1
+#define PREC_FLOAT 2
+
+// Layouts of the pixels read by the distance kernels of the assignment
+
+#define LAYOUT_INTERLEAVED 0
+#define LAYOUT_PLANAR 1
+
+// Sources of the farthest pixels moved to the empty clusters by lloyd
+
+#define REPAIR_SCAN 0
+#define REPAIR_HEAP 1
+
+// Criteria that stopped the iterations, none when the maximum number of
+// iterations is reached
+
+#define STOP_NONE 0
+#define STOP_CONVERGED 1
+#define STOP_CHANGES 2
+#define STOP_SSE 3
+#define STOP_SHIFT 4
+#define STOP_DEADLINE 5
+
+// Computations of the center sums at each iteration
+
+#define UPDATE_FULL 0
+#define UPDATE_INCREMENTAL 1
+
+// Placements of the buffers of the points in memory
+
+#define PLACE_DEFAULT 0
+#define PLACE_NUMA 1
+
+// Bindings of the threads to the CPUs
+
+#define PIN_NONE 0
+#define PIN_CLOSE 1
+#define PIN_SPREAD 2
+
+// Number of threads that lets the parallel version choose its own
+
+#define THREADS_AUTO 0
+
+typedef struct {
+    int algo;
+    int init;
+    unsigned int seed;      // Seed of all the random draws
+    int reduce;
+    int hist_bits;          // Bits per channel of the histogram bins
+    int batch_size;         // Pixels sampled at each iteration of mini-batch
+    int precision;          // Arithmetic of the distances computed by lloyd and minibatch
+    int layout;             // Layout of the pixels read by lloyd and minibatch
+    int repair;             // Source of the pixels moved to the empty clusters by lloyd
+    int update;             // Computation of the center sums, from all the points or only the changed ones
+    double tol_changes;     // Stop when at most this fraction of the pixels changes cluster
+    double tol_sse;         // Stop when the SSE decreases by at most this fraction
+    double tol_shift;       // Stop when no center moves by more than this distance
+    double deadline;        // Time budget of the clustering in seconds, parallel version only
+    int placement;          // Placement of the buffers of the points, parallel version only
+    int pin;                // Binding of the threads to the CPUs, parallel version only
+    int n_points;           // Output: number of points actually clustered
+    int kernel;             // Output: distance kernel selected for the CPU
+    int n_threads;          // Output: number of threads used by the parallel version
+    int stop;               // Output: criterion that stopped the iterations
+    long long n_dists;      // Output: number of distances computed
+    long long n_skipped;    // Output: number of distances skipped thanks to bounds
+} segm_params_t;
+
+void kmeans_segm(byte_t *data, int width, int height, int n_ch, int n_clus, int *n_iters, double *sse, segm_params_t *params);
+void kmeans_segm_omp(byte_t *data, int width, int height, int n_ch, int n_clus, int *n_iters, double *sse, int n_threads, segm_params_t *params);
 
 #endif
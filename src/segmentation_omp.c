@@ -1,65 +1,488 @@
+#define _GNU_SOURCE
+
 #include <stdlib.h>
+#include <string.h>
+#include <sched.h>
 #include <float.h>
 #include <math.h>
 #include <omp.h>
 
 #include "image_io.h"
+#include "random.h"
+#include "distance.h"
+#include "labels.h"
+#include "farthest.h"
+#include "tuning.h"
 #include "segmentation.h"
 
-void init_centers(byte_t *data, double *centers, int n_px, int n_ch, int n_clus);
-void assign_pixels(byte_t *data, double *centers, int *labels, double *dists, int *changes, int n_px, int n_ch, int n_clus);
-void update_centers(byte_t *data, double *centers, int *labels, double *dists, int n_px, int n_ch, int n_clus);
-void update_data(byte_t *data, double *centers, int *labels, int n_px, int n_ch);
-void compute_sse(double *sse, double *dists, int n_px);
+#define YINYANG_GROUP_SIZE 10
+#define YINYANG_GROUP_ITERS 5
+#define HIST_MAX_BITS 20
+#define KMEANSPAR_ROUNDS 5
+#define KMEANSPAR_OVERSAMPLING 2
+#define KMEANSPAR_ITERS 10
+#define CACHE_LINE 64
+#define ACCUM_TREE_THREADS 32
+#define TUNE_MAX_WORK (1LL << 26)
+#define TUNE_PASSES 3
+
+// Every thread accumulates the sums and counts of the centers in its own copy,
+// padded to whole cache lines so that the copies of two threads never share a
+// line. The copies are contiguous and the first one receives the merged total
+
+#define PAD_TO_LINE(n, size) (((size_t)(n) * (size) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE / (size))
+#define SUMS_STRIDE(n_ch, n_clus) PAD_TO_LINE((n_ch) * (n_clus), sizeof(double))
+#define COUNTS_STRIDE(n_clus) PAD_TO_LINE(n_clus, sizeof(int))
+#define THR_SUMS(sums, n_ch, n_clus) ((sums) + omp_get_thread_num() * SUMS_STRIDE(n_ch, n_clus))
+#define THR_COUNTS(counts, n_clus) ((counts) + omp_get_thread_num() * COUNTS_STRIDE(n_clus))
+
+// Every thread also keeps its scratch buffers across the iterations, in a
+// padded slice of a shared block: the centers converted for the fixed and
+// float kernels and the farthest pixels of its share for the assignment, the
+// closest centers of each group for yinyang
 
-void kmeans_segm_omp(byte_t *data, int width, int height, int n_ch, int n_clus, int *n_iters, double *sse, int n_threads)
+#define CONV_SIZE(n_clus) PAD_TO_LINE((n_clus) * DIST_MAX_CH * sizeof(float), 1)
+#define ASSIGN_SCRATCH(n_clus) (CONV_SIZE(n_clus) + (n_clus) * (sizeof(double) + sizeof(int)))
+#define YINYANG_SCRATCH(n_grps) ((n_grps) * (2 * sizeof(double) + sizeof(int)))
+#define THR_SCRATCH(scratch, size) ((char *)(scratch) + omp_get_thread_num() * PAD_TO_LINE(size, 1))
+
+void init_centers(byte_t *data, double *centers, int n_px, int n_ch, int n_clus, unsigned int seed);
+void init_centers_kmeanspp(byte_t *data, int *weights, double *centers, int n_px, int n_ch, int n_clus, unsigned int seed);
+void init_centers_kmeanspar(byte_t *data, double *centers, int n_px, int n_ch, int n_clus, unsigned int seed);
+void assign_pixels(byte_t *data, int *weights, double *centers, void *labels, double *dists, double *far_dists, int *far_idx, int *n_far, double *sums, int *counts, void *scratch, int *changes, int n_px, int n_ch, int n_clus, int precision, int plane, int incremental, int l_size);
+void update_centers(byte_t *data, double *centers, double *sums, int *counts, double *dists, double *far_dists, int *far_idx, int *n_far, int n_px, int n_ch, int n_clus);
+void find_farthest(double *dists, double *far_dists, int *far_idx, int *n_far, int n_px, int max_far);
+int accumulate_pixels(byte_t *data, int *weights, int *near, void *labels, double *sums, int *counts, int n_px, int n_ch, int px_step, int ch_step, int incremental, int l_size);
+double *alloc_sums(int n_ch, int n_clus);
+int *alloc_counts(int n_clus);
+void *alloc_scratch(size_t size);
+void reset_accums(double *sums, int *counts, int n_ch, int n_clus, int incremental);
+void merge_accums(double *sums, int *counts, int n_ch, int n_clus);
+int tune_threads(byte_t *data, double *centers, int n_px, int n_ch, int n_clus);
+void pin_threads(int pin);
+byte_t *copy_pixels(byte_t *data, int n_px, int n_ch);
+void touch_pixels(void *buf, int n_px, size_t px_size, int value);
+void update_data(byte_t *data, double *centers, void *labels, int *px_map, int n_px, int n_ch, int l_size);
+void to_planar(byte_t *data, byte_t *planes, int n_px, int n_ch);
+void update_data_ch(byte_t *data, double *centers, void *labels, int *px_map, int n_px, int n_ch, int l_size);
+void compute_sse(byte_t *data, int *weights, double *centers, void *labels, int *px_map, double *sse, int n_px, int n_ch, int n_clus, int l_size);
+long long sum_squares(byte_t *data, int *weights, int n_px, int n_ch);
+int check_stop(double *sums, int *counts, double *drifts, double *prev_sse, long long sq_total, int changes, int n_px, int n_ch, int n_clus, int iter, segm_params_t *params);
+int check_deadline(double start_time, double *iter_start, double final_time, double deadline);
+int reduce_unique(byte_t *data, byte_t **pts, int **weights, int *px_map, int n_px, int n_ch);
+int reduce_hist(byte_t *data, byte_t **pts, int **weights, int *px_map, int n_px, int n_ch, int bits);
+void add_hist_run(int *counts, long long *sums, int bin, int count, long long *run_sums, int n_ch);
+void compute_drifts(double *old_centers, double *centers, double *drifts, int n_ch, int n_clus);
+void compute_center_dists(double *centers, double *c_dists, double *s, int n_ch, int n_clus);
+void assign_pixels_elkan(byte_t *data, int *weights, double *centers, void *labels, double *sums, int *counts, double *upper, double *lower, double *c_dists, double *s, int *changes, long long *n_dists, int n_px, int n_ch, int n_clus, int first, int incremental, int l_size);
+void update_bounds_elkan(void *labels, double *upper, double *lower, double *drifts, int n_px, int n_clus, int l_size);
+void assign_pixels_hamerly(byte_t *data, int *weights, double *centers, void *labels, double *sums, int *counts, double *upper, double *lower, double *c_dists, double *s, int *changes, long long *n_dists, int n_px, int n_ch, int n_clus, int first, int incremental, int l_size);
+void update_bounds_hamerly(void *labels, double *upper, double *lower, double *drifts, int n_px, int n_clus, int l_size);
+void group_centers(double *centers, int *grp_start, int *grp_centers, int *grp_of, int n_ch, int n_clus, int n_grps);
+void assign_pixels_yinyang(byte_t *data, int *weights, double *centers, void *labels, double *sums, int *counts, double *upper, double *lower, int *grp_start, int *grp_centers, int *grp_of, void *scratch, int *changes, long long *n_dists, int n_px, int n_ch, int n_clus, int n_grps, int first, int incremental, int l_size);
+void update_bounds_yinyang(void *labels, double *upper, double *lower, double *drifts, double *grp_drifts, int *grp_start, int *grp_centers, int n_px, int n_grps, int l_size);
+void sample_batch(int *batch, int n_px, int batch_size, unsigned int seed, int iter);
+void update_centers_minibatch(byte_t *data, int *weights, double *centers, int *batch, double *totals, double *sums, int *counts, void *scratch, int batch_size, int n_ch, int n_clus, int precision, int planar);
+double px_dist(byte_t *px_data, double *center, int n_ch);
+double center_dist(double *center_a, double *center_b, int n_ch);
+
+void kmeans_segm_omp(byte_t *data, int width, int height, int n_ch, int n_clus, int *n_iters, double *sse, int n_threads, segm_params_t *params)
 {
-    int n_px;
+    int n_px, n_pts;
     int iter, max_iters;
-    int changes;
-    int *labels;
+    int changes, bounded, tracked, stop = STOP_NONE, n_grps = 0, n_far = 0;
+    long long n_dists, sq_total = 0;
+    int l_size;
+    int *counts;
+    byte_t *numa_pts;
+    void *labels, *scratch;
+    int *weights = NULL, *px_map = NULL, *batch = NULL, *far_idx = NULL;
+    int *grp_start = NULL, *grp_centers = NULL, *grp_of = NULL;
     double *centers;
-    double *dists;
+    double *sums, *dists = NULL, *far_dists = NULL;
+    double *old_centers = NULL, *drifts = NULL, prev_sse = 0;
+    double *upper = NULL, *lower = NULL, *c_dists = NULL, *s = NULL;
+    double *grp_drifts = NULL, *totals = NULL;
+    double start_time, iter_start, batch_start, final_time;
+    byte_t *pts, *planes = NULL;
+
+    // The time budget covers the whole call, from the reduction to the
+    // colors written back to the image
+
+    start_time = omp_get_wtime();
 
     max_iters = *n_iters;
 
     n_px = width * height;
 
-    labels = malloc(n_px * sizeof(int));
+    // In auto mode the centers and the reduction use all the CPUs, the
+    // clustering the number of threads chosen on the points to cluster
+
+    omp_set_num_threads(n_threads == THREADS_AUTO ? omp_get_num_procs() : n_threads);
+
+    params->kernel = select_dist_kernel();
+
     centers = malloc(n_clus * n_ch * sizeof(double));
-    dists = malloc(n_px * sizeof(double));
 
-    omp_set_num_threads(n_threads);
+    switch (params->init) {
+        case INIT_KMEANSPP:
+            init_centers_kmeanspp(data, NULL, centers, n_px, n_ch, n_clus, params->seed);
+            break;
+        case INIT_KMEANSPAR:
+            init_centers_kmeanspar(data, centers, n_px, n_ch, n_clus, params->seed);
+            break;
+        default:
+            init_centers(data, centers, n_px, n_ch, n_clus, params->seed);
+            break;
+    }
+
+    // Clustering either the pixels or a table of colors weighted by the
+    // number of pixels they stand for
+
+    switch (params->reduce) {
+        case REDUCE_UNIQUE:
+            px_map = malloc(n_px * sizeof(int));
+            n_pts = reduce_unique(data, &pts, &weights, px_map, n_px, n_ch);
+            break;
+        case REDUCE_HIST:
+            px_map = malloc(n_px * sizeof(int));
+            n_pts = reduce_hist(data, &pts, &weights, px_map, n_px, n_ch, params->hist_bits);
+            break;
+        default:
+            pts = data;
+            n_pts = n_px;
+            break;
+    }
+
+    params->n_points = n_pts;
+
+    if (n_threads == THREADS_AUTO) {
+        n_threads = tune_threads(pts, centers, n_pts, n_ch, n_clus);
+        omp_set_num_threads(n_threads);
+    }
+
+    params->n_threads = n_threads;
+
+    // The threads are bound before they write the buffers below, so that the
+    // pages stay on the nodes of the CPUs they are bound to
+
+    if (params->pin != PIN_NONE) {
+        pin_threads(params->pin);
+    }
+
+    // The points loaded or reduced by the main thread are copied so that each
+    // page lands on the NUMA node of the thread that assigns its points
+
+    if (params->placement == PLACE_NUMA) {
+        numa_pts = copy_pixels(pts, n_pts, n_ch);
+
+        if (pts != data) {
+            free(pts);
+        }
+
+        pts = numa_pts;
+    }
+
+    // The assignment of lloyd and minibatch can read the points from a planar
+    // copy, where each channel is contiguous
+
+    if (params->layout == LAYOUT_PLANAR && (params->algo == ALGO_LLOYD || params->algo == ALGO_MINIBATCH)) {
+        planes = malloc((size_t)n_pts * n_ch * sizeof(byte_t));
+        to_planar(pts, planes, n_pts, n_ch);
+    }
+
+    // Labels use the narrowest type that fits the clusters, and start as
+    // unassigned so that the first assignment counts every pixel as changed
+
+    l_size = LABEL_SIZE(n_clus);
+    labels = malloc((size_t)n_pts * l_size);
 
-    init_centers(data, centers, n_px, n_ch, n_clus);
+    if (params->placement == PLACE_NUMA) {
+        touch_pixels(labels, n_pts, l_size, LABEL_NONE);
+    } else {
+        memset(labels, LABEL_NONE, (size_t)n_pts * l_size);
+    }
+    sums = alloc_sums(n_ch, n_clus);
+    counts = alloc_counts(n_clus);
+
+    switch (params->algo) {
+        case ALGO_ELKAN:
+            // Elkan keeps an upper bound for each pixel and a lower bound for
+            // each pair of pixel and center, plus the table of center distances
+
+            lower = malloc((size_t)n_pts * n_clus * sizeof(double));
+            break;
+        case ALGO_HAMERLY:
+            // Hamerly keeps a single lower bound for each pixel, referred to
+            // the second closest center. With the upper bound that makes two
+            // doubles per pixel, kept in double like the bounds of the other
+            // algorithms so that they never skip a distance by rounding
 
-    for (iter = 0; iter < max_iters; iter++) {
-        assign_pixels(data, centers, labels, dists, &changes, n_px, n_ch, n_clus);
+            lower = malloc(n_pts * sizeof(double));
+            break;
+        case ALGO_YINYANG:
+            // Yinyang keeps a lower bound for each pixel and group of centers
+
+            n_grps = n_clus / YINYANG_GROUP_SIZE > 1 ? n_clus / YINYANG_GROUP_SIZE : 1;
+            lower = malloc((size_t)n_pts * n_grps * sizeof(double));
+            grp_start = malloc((n_grps + 1) * sizeof(int));
+            grp_centers = malloc(n_clus * sizeof(int));
+            grp_of = malloc(n_clus * sizeof(int));
+            grp_drifts = malloc(n_grps * sizeof(double));
+            break;
+        case ALGO_MINIBATCH:
+            // Mini-batch keeps the total weight of the pixels each center has
+            // absorbed, which sets its learning rate
 
-        if (!changes) {
+            batch = malloc(params->batch_size * sizeof(int));
+            totals = calloc(n_clus, sizeof(double));
             break;
+    }
+
+    // The scratch slices fit the buffers of both the assignment of lloyd and
+    // minibatch and the group search of yinyang
+
+    scratch = alloc_scratch(ASSIGN_SCRATCH(n_clus) > YINYANG_SCRATCH(n_grps) ? ASSIGN_SCRATCH(n_clus) : YINYANG_SCRATCH(n_grps));
+
+    bounded = params->algo == ALGO_ELKAN || params->algo == ALGO_HAMERLY || params->algo == ALGO_YINYANG;
+
+    // The drifts of the centers are tracked by the bounded algorithms and by
+    // the tolerance on the center shift
+
+    tracked = bounded || params->tol_shift > 0;
+
+    if (tracked) {
+        old_centers = malloc(n_clus * n_ch * sizeof(double));
+        drifts = malloc(n_clus * sizeof(double));
+    }
+
+    if (bounded) {
+        upper = malloc(n_pts * sizeof(double));
+        c_dists = malloc(n_clus * n_clus * sizeof(double));
+        s = malloc(n_clus * sizeof(double));
+    }
+
+    // The distances of all the points are kept only when the repair of empty
+    // clusters scans them, while the bounded algorithms scan their upper
+    // bounds. Otherwise the assignment keeps the farthest points, one for each
+    // cluster at most empty, in the same arrays that receive the result of the
+    // scan
+
+    if (!bounded && params->repair == REPAIR_SCAN) {
+        dists = malloc(n_pts * sizeof(double));
+    }
+
+    // The buffers of the points are first written by the same threads that
+    // will read them in the assignment, with the same static schedule
+
+    if (params->placement == PLACE_NUMA) {
+        if (dists) {
+            touch_pixels(dists, n_pts, sizeof(double), 0);
+        }
+
+        if (bounded) {
+            touch_pixels(upper, n_pts, sizeof(double), 0);
         }
 
-        update_centers(data, centers, labels, dists, n_px, n_ch, n_clus);
+        switch (params->algo) {
+            case ALGO_ELKAN:
+                touch_pixels(lower, n_pts, n_clus * sizeof(double), 0);
+                break;
+            case ALGO_HAMERLY:
+                touch_pixels(lower, n_pts, sizeof(double), 0);
+                break;
+            case ALGO_YINYANG:
+                touch_pixels(lower, n_pts, n_grps * sizeof(double), 0);
+                break;
+        }
+    }
+
+    far_dists = malloc(n_clus * sizeof(double));
+    far_idx = malloc(n_clus * sizeof(int));
+
+    params->n_dists = 0;
+    params->n_skipped = 0;
+
+    if (params->tol_sse > 0) {
+        sq_total = sum_squares(pts, weights, n_pts, n_ch);
+    }
+
+    if (params->algo == ALGO_YINYANG) {
+        group_centers(centers, grp_start, grp_centers, grp_of, n_ch, n_clus, n_grps);
+    }
+
+    // The threads run all the iterations in a single parallel region, and
+    // share the work of each step with worksharing constructs, so the team
+    // is not forked and joined again at every step
+
+    iter_start = omp_get_wtime();
+
+    #pragma omp parallel private(iter)
+    {
+        for (iter = 0; iter < max_iters; iter++) {
+            switch (params->algo) {
+                case ALGO_ELKAN:
+                    assign_pixels_elkan(pts, weights, centers, labels, sums, counts, upper, lower, c_dists, s, &changes, &n_dists, n_pts, n_ch, n_clus, iter == 0, iter && params->update == UPDATE_INCREMENTAL, l_size);
+                    break;
+                case ALGO_HAMERLY:
+                    assign_pixels_hamerly(pts, weights, centers, labels, sums, counts, upper, lower, c_dists, s, &changes, &n_dists, n_pts, n_ch, n_clus, iter == 0, iter && params->update == UPDATE_INCREMENTAL, l_size);
+                    break;
+                case ALGO_YINYANG:
+                    assign_pixels_yinyang(pts, weights, centers, labels, sums, counts, upper, lower, grp_start, grp_centers, grp_of, scratch, &changes, &n_dists, n_pts, n_ch, n_clus, n_grps, iter == 0, iter && params->update == UPDATE_INCREMENTAL, l_size);
+                    break;
+                case ALGO_MINIBATCH:
+                    sample_batch(batch, n_pts, params->batch_size, params->seed, iter);
+
+                    #pragma omp single
+                    {
+                        n_dists = (long long)params->batch_size * n_clus;
+                        changes = 1;
+                    }
+                    break;
+                default:
+                    assign_pixels(planes ? planes : pts, weights, centers, labels, dists, far_dists, far_idx, &n_far, sums, counts, scratch, &changes, n_pts, n_ch, n_clus, params->precision, planes ? n_pts : 0, iter && params->update == UPDATE_INCREMENTAL, l_size);
+
+                    #pragma omp single
+                    n_dists = (long long)n_pts * n_clus;
+                    break;
+            }
+
+            #pragma omp single
+            {
+                params->n_dists += n_dists;
+                // The pixels left out of a batch are not skipped by bounds
+
+                if (params->algo != ALGO_MINIBATCH) {
+                    params->n_skipped += (long long)n_pts * n_clus - n_dists;
+                }
+            }
+
+            // Every thread reads the same flag, which is reset only after the
+            // barrier of the next step
+
+            if (!changes) {
+                #pragma omp single
+                stop = STOP_CONVERGED;
+                break;
+            }
+
+            if (tracked) {
+                #pragma omp single
+                memcpy(old_centers, centers, n_clus * n_ch * sizeof(double));
+            }
+
+            if (params->algo == ALGO_MINIBATCH) {
+                if (params->deadline > 0) {
+                    #pragma omp single
+                    batch_start = omp_get_wtime();
+                }
+
+                update_centers_minibatch(pts, weights, centers, batch, totals, sums, counts, scratch, params->batch_size, n_ch, n_clus, params->precision, params->layout == LAYOUT_PLANAR);
+            } else {
+                update_centers(pts, centers, sums, counts, bounded ? upper : dists, far_dists, far_idx, &n_far, n_pts, n_ch, n_clus);
+            }
+
+            if (tracked) {
+                compute_drifts(old_centers, centers, drifts, n_ch, n_clus);
+            }
+
+            // The iteration counts as done, as the centers have been moved
+
+            #pragma omp single
+            {
+                stop = check_stop(sums, counts, drifts, &prev_sse, sq_total, changes, n_px, n_ch, n_clus, iter, params);
+
+                if (stop == STOP_NONE && params->deadline > 0) {
+                    // After the iterations minibatch still assigns all the
+                    // points, estimated at the cost per point of the last
+                    // batch, an upper bound as the batch also moves the centers
+
+                    final_time = params->algo == ALGO_MINIBATCH ? (omp_get_wtime() - batch_start) * n_pts / params->batch_size : 0;
+                    stop = check_deadline(start_time, &iter_start, final_time, params->deadline);
+                }
+            }
+
+            if (stop != STOP_NONE) {
+                iter++;
+                break;
+            }
+
+            switch (params->algo) {
+                case ALGO_ELKAN:
+                    update_bounds_elkan(labels, upper, lower, drifts, n_pts, n_clus, l_size);
+                    break;
+                case ALGO_HAMERLY:
+                    update_bounds_hamerly(labels, upper, lower, drifts, n_pts, n_clus, l_size);
+                    break;
+                case ALGO_YINYANG:
+                    update_bounds_yinyang(labels, upper, lower, drifts, grp_drifts, grp_start, grp_centers, n_pts, n_grps, l_size);
+                    break;
+            }
+        }
+
+        #pragma omp single
+        {
+            *n_iters = iter;
+            params->stop = stop;
+        }
+
+        if (params->algo == ALGO_MINIBATCH) {
+            // Batches only move the centers, the pixels are assigned once at the end
+
+            assign_pixels(planes ? planes : pts, weights, centers, labels, dists, far_dists, far_idx, &n_far, sums, counts, scratch, &changes, n_pts, n_ch, n_clus, params->precision, planes ? n_pts : 0, 0, l_size);
+
+            #pragma omp single
+            params->n_dists += (long long)n_pts * n_clus;
+        }
     }
 
-    update_data(data, centers, labels, n_px, n_ch);
+    // The bins of the histogram stand for pixels of different colors, so the
+    // SSE is measured on the pixels of the image to include the error inside
+    // each bin
+
+    if (params->reduce == REDUCE_HIST) {
+        compute_sse(data, NULL, centers, labels, px_map, sse, n_px, n_ch, n_clus, l_size);
+    } else {
+        compute_sse(pts, weights, centers, labels, NULL, sse, n_pts, n_ch, n_clus, l_size);
+    }
 
-    compute_sse(sse, dists, n_px);
+    update_data(data, centers, labels, px_map, n_px, n_ch, l_size);
 
-    *n_iters = iter;
+    if (pts != data) {
+        free(pts);
+        free(weights);
+        free(px_map);
+    }
 
+    free(planes);
     free(centers);
     free(labels);
     free(dists);
+    free(far_dists);
+    free(far_idx);
+    free(sums);
+    free(counts);
+    free(scratch);
+    free(old_centers);
+    free(drifts);
+    free(upper);
+    free(lower);
+    free(c_dists);
+    free(s);
+    free(grp_start);
+    free(grp_centers);
+    free(grp_of);
+    free(grp_drifts);
+    free(batch);
+    free(totals);
 }
 
-void init_centers(byte_t *data, double *centers, int n_px, int n_ch, int n_clus)
+void init_centers(byte_t *data, double *centers, int n_px, int n_ch, int n_clus, unsigned int seed)
 {
     int k, ch, rnd;
 
     for (k = 0; k < n_clus; k++) {
-        rnd = rand() % n_px;
+        rnd = rand_index(seed, RNG_INIT, k, n_px);
 
         for (ch = 0; ch < n_ch; ch++) {
             centers[k * n_ch + ch] = data[rnd * n_ch + ch];
@@ -67,126 +490,1794 @@ void init_centers(byte_t *data, double *centers, int n_px, int n_ch, int n_clus)
     }
 }
 
-void assign_pixels(byte_t *data, double *centers, int *labels, double *dists, int *changes, int n_px, int n_ch, int n_clus)
+void init_centers_kmeanspp(byte_t *data, int *weights, double *centers, int n_px, int n_ch, int n_clus, unsigned int seed)
 {
-    int px, ch, k;
-    int min_k, tmp_changes = 0;
-    double dist, min_dist, tmp;
+    int px, ch, k, t, sel, tmp, dist;
+    int n_thr, thr, lo, hi;
+    int *min_dists;
+    long long total, rnd, part, *parts;
 
-    #pragma omp parallel for schedule(static) private(px, ch, k, min_k, dist, min_dist, tmp)
-    for (px = 0; px < n_px; px++) {
-        min_dist = DBL_MAX;
+    min_dists = malloc(n_px * sizeof(int));
+    parts = malloc(omp_get_max_threads() * sizeof(long long));
 
-        for (k = 0; k < n_clus; k++) {
-            dist = 0;
+    sel = rand_index(seed, RNG_KMEANSPP, 0, n_px);
 
-            for (ch = 0; ch < n_ch; ch++) {
-                tmp = (double)(data[px * n_ch + ch] - centers[k * n_ch + ch]);
-                dist += tmp * tmp;
-            }
+    for (k = 0; k < n_clus; k++) {
+        for (ch = 0; ch < n_ch; ch++) {
+            centers[k * n_ch + ch] = data[sel * n_ch + ch];
+        }
+
+        if (k == n_clus - 1) {
+            break;
+        }
+
+        // Updating the squared distance of each pixel from its closest center,
+        // summed over the contiguous chunk of each thread. Centers are pixels,
+        // so the distances are exact integers and the sampling below does not
+        // depend on the number of threads
+
+        #pragma omp parallel private(px, ch, thr, lo, hi, tmp, dist, part)
+        {
+            thr = omp_get_thread_num();
+            lo = (long long)n_px * thr / omp_get_num_threads();
+            hi = (long long)n_px * (thr + 1) / omp_get_num_threads();
+            part = 0;
+
+            for (px = lo; px < hi; px++) {
+                dist = 0;
 
-            if (dist < min_dist) {
-                min_dist = dist;
-                min_k = k;
+                for (ch = 0; ch < n_ch; ch++) {
+                    tmp = data[px * n_ch + ch] - data[sel * n_ch + ch];
+                    dist += tmp * tmp;
+                }
+
+                if (k == 0 || dist < min_dists[px]) {
+                    min_dists[px] = dist;
+                }
+
+                part += (long long)(weights ? weights[px] : 1) * min_dists[px];
             }
+
+            parts[thr] = part;
+
+            #pragma omp master
+            n_thr = omp_get_num_threads();
+        }
+
+        for (t = 0, total = 0; t < n_thr; t++) {
+            total += parts[t];
         }
 
-        dists[px] = min_dist;
+        // Sampling the next center with probability proportional to the
+        // weighted squared distance, or uniformly if all pixels are already
+        // centers
 
-        if (labels[px] != min_k) {
-            labels[px] = min_k;
-            tmp_changes = 1;
+        if (!total) {
+            sel = rand_index(seed, RNG_KMEANSPP, 0, n_px);
+            continue;
         }
+
+        rnd = rand_u64(seed, RNG_KMEANSPP, k + 1) % total;
+
+        for (t = 0; rnd >= parts[t]; t++) {
+            rnd -= parts[t];
+        }
+
+        for (px = (long long)n_px * t / n_thr; rnd >= (long long)(weights ? weights[px] : 1) * min_dists[px]; px++) {
+            rnd -= (long long)(weights ? weights[px] : 1) * min_dists[px];
+        }
+
+        sel = px;
     }
 
-    *changes = tmp_changes;
+    free(min_dists);
+    free(parts);
 }
 
-void update_centers(byte_t *data, double *centers, int *labels, double *dists, int n_px, int n_ch, int n_clus)
+void init_centers_kmeanspar(byte_t *data, double *centers, int n_px, int n_ch, int n_clus, unsigned int seed)
 {
-    int px, ch, k;
-    int *counts;
-    int min_k, far_px;
-    double max_dist;
+    int px, ch, c, r, t, iter, tmp, dist, changes;
+    int n_thr, thr, lo, hi, cnt;
+    int n_cands, new_cands, l_size;
+    int *min_dists, *nearest, *cand_weights, *cand_counts, *offsets;
+    long long cost, part, *parts;
+    int n_far, *far_idx;
+    double *cand_sums, *far_dists;
+    void *cand_labels, *scratch;
+    byte_t *cands;
 
-    counts = malloc(n_clus * sizeof(int));
+    min_dists = malloc(n_px * sizeof(int));
+    nearest = malloc(n_px * sizeof(int));
+    parts = malloc(omp_get_max_threads() * sizeof(long long));
+    offsets = malloc(omp_get_max_threads() * sizeof(int));
 
-    // Resetting centers and initializing clusters counters
+    // Starting from a single candidate chosen uniformly
 
-    for (k = 0; k < n_clus; k++) {
-        for (ch = 0; ch < n_ch; ch++) {
-            centers[k * n_ch + ch] = 0;
+    px = rand_index(seed, RNG_KMEANSPAR, 0, n_px);
+    cands = malloc(n_ch * sizeof(byte_t));
+    memcpy(cands, data + px * n_ch, n_ch);
+    n_cands = new_cands = 1;
+
+    for (r = 0; ; r++) {
+        // Updating the squared distance of each pixel from its closest
+        // candidate with the candidates added in the last round. Distances
+        // are exact integers, so the cost does not depend on the threads
+
+        #pragma omp parallel private(px, ch, c, thr, lo, hi, tmp, dist, part)
+        {
+            thr = omp_get_thread_num();
+            lo = (long long)n_px * thr / omp_get_num_threads();
+            hi = (long long)n_px * (thr + 1) / omp_get_num_threads();
+            part = 0;
+
+            for (px = lo; px < hi; px++) {
+                for (c = n_cands - new_cands; c < n_cands; c++) {
+                    dist = 0;
+
+                    for (ch = 0; ch < n_ch; ch++) {
+                        tmp = data[px * n_ch + ch] - cands[c * n_ch + ch];
+                        dist += tmp * tmp;
+                    }
+
+                    if (c == 0 || dist < min_dists[px]) {
+                        min_dists[px] = dist;
+                        nearest[px] = c;
+                    }
+                }
+
+                part += min_dists[px];
+            }
+
+            parts[thr] = part;
+
+            #pragma omp master
+            n_thr = omp_get_num_threads();
+        }
+
+        for (t = 0, cost = 0; t < n_thr; t++) {
+            cost += parts[t];
+        }
+
+        if (r == KMEANSPAR_ROUNDS || !cost) {
+            break;
+        }
+
+        // Oversampling each pixel independently with probability proportional
+        // to its squared distance. The draw only depends on the seed, the
+        // round and the pixel, and the sampled pixels are appended in order
+
+        #pragma omp parallel private(px, thr, lo, hi, cnt)
+        {
+            thr = omp_get_thread_num();
+            lo = (long long)n_px * thr / omp_get_num_threads();
+            hi = (long long)n_px * (thr + 1) / omp_get_num_threads();
+            cnt = 0;
+
+            for (px = lo; px < hi; px++) {
+                if (rand_unit(seed, RNG_KMEANSPAR + r + 1, px) * cost < (double)KMEANSPAR_OVERSAMPLING * n_clus * min_dists[px]) {
+                    cnt++;
+                }
+            }
+
+            offsets[thr] = cnt;
+
+            #pragma omp barrier
+            #pragma omp single
+            {
+                for (t = 0, new_cands = 0; t < omp_get_num_threads(); t++) {
+                    cnt = offsets[t];
+                    offsets[t] = n_cands + new_cands;
+                    new_cands += cnt;
+                }
+
+                cands = realloc(cands, (n_cands + new_cands) * n_ch * sizeof(byte_t));
+            }
+
+            for (px = lo, cnt = offsets[thr]; px < hi; px++) {
+                if (rand_unit(seed, RNG_KMEANSPAR + r + 1, px) * cost < (double)KMEANSPAR_OVERSAMPLING * n_clus * min_dists[px]) {
+                    memcpy(cands + cnt++ * n_ch, data + px * n_ch, n_ch);
+                }
+            }
         }
 
-        counts[k] = 0;
+        n_cands += new_cands;
     }
 
-    // Computing partial sums of the centers and updating clusters counters
+    // Weighting each candidate by the number of pixels closest to it
+
+    cand_weights = calloc(n_cands, sizeof(int));
+    l_size = LABEL_SIZE(n_clus);
+    cand_labels = malloc((size_t)n_cands * l_size);
+    memset(cand_labels, LABEL_NONE, (size_t)n_cands * l_size);
+    far_dists = malloc(n_clus * sizeof(double));
+    far_idx = malloc(n_clus * sizeof(int));
+    cand_sums = alloc_sums(n_ch, n_clus);
+    cand_counts = alloc_counts(n_clus);
+    scratch = alloc_scratch(ASSIGN_SCRATCH(n_clus));
 
-    #pragma omp parallel for private(px, ch, min_k) reduction(+:centers[:n_clus * n_ch],counts[:n_clus])
+    #pragma omp parallel for private(px) reduction(+:cand_weights[:n_cands])
     for (px = 0; px < n_px; px++) {
-        min_k = labels[px];
+        cand_weights[nearest[px]]++;
+    }
 
-        for (ch = 0; ch < n_ch; ch++) {
-            centers[min_k * n_ch + ch] += data[px * n_ch + ch];
+    // Reclustering the weighted candidates into the initial centers
+
+    init_centers_kmeanspp(cands, cand_weights, centers, n_cands, n_ch, n_clus, seed);
+
+    #pragma omp parallel private(iter)
+    {
+        for (iter = 0; iter < KMEANSPAR_ITERS; iter++) {
+            assign_pixels(cands, cand_weights, centers, cand_labels, NULL, far_dists, far_idx, &n_far, cand_sums, cand_counts, scratch, &changes, n_cands, n_ch, n_clus, PREC_DOUBLE, 0, 0, l_size);
+
+            if (!changes) {
+                break;
+            }
+
+            update_centers(cands, centers, cand_sums, cand_counts, NULL, far_dists, far_idx, &n_far, n_cands, n_ch, n_clus);
         }
+    }
 
-        counts[min_k]++;
+    free(min_dists);
+    free(nearest);
+    free(parts);
+    free(offsets);
+    free(cands);
+    free(cand_weights);
+    free(cand_labels);
+    free(far_dists);
+    free(far_idx);
+    free(cand_sums);
+    free(cand_counts);
+    free(scratch);
+}
+
+void assign_pixels(byte_t *data, int *weights, double *centers, void *labels, double *dists, double *far_dists, int *far_idx, int *n_far, double *sums, int *counts, void *scratch, int *changes, int n_px, int n_ch, int n_clus, int precision, int plane, int incremental, int l_size)
+{
+    int px, n, i, changed;
+    int px_step, ch_step;
+    int tmp_changes = 0;
+    int near[DIST_BLOCK];
+    int thr_far = 0, *thr_idx, *thr_counts;
+    double blk_dists[DIST_BLOCK], *out_dists, *thr_dists, *thr_sums;
+    short *fx_centers;
+    float *f_centers;
+    char *thr_scratch;
+
+    // Called by all the threads of the team: the locals are private to each
+    // thread, the results are shared through the arguments
+
+    px_step = plane ? 1 : n_ch;
+    ch_step = plane ? plane : 1;
+
+    #pragma omp single
+    {
+        *changes = 0;
+        *n_far = 0;
     }
 
-    // Dividing to obtain the centers mean
+    reset_accums(sums, counts, n_ch, n_clus, incremental);
+    thr_sums = THR_SUMS(sums, n_ch, n_clus);
+    thr_counts = THR_COUNTS(counts, n_clus);
 
-    for (k = 0; k < n_clus; k++) {
-        if (counts[k]) {
-            for (ch = 0; ch < n_ch; ch++) {
-                centers[k * n_ch + ch] /= counts[k];
-            }
-        } else {
-            // If the cluster is empty we find the farthest pixel from its cluster center
+    thr_scratch = THR_SCRATCH(scratch, ASSIGN_SCRATCH(n_clus));
+    fx_centers = (short *)thr_scratch;
+    f_centers = (float *)thr_scratch;
+    thr_dists = (double *)(thr_scratch + CONV_SIZE(n_clus));
+    thr_idx = (int *)(thr_dists + n_clus);
+
+    // Each thread converts its own copy of the centers
+
+    if (precision == PREC_FIXED) {
+        quantize_centers(centers, fx_centers, n_ch, n_clus);
+    } else if (precision == PREC_FLOAT) {
+        convert_centers(centers, f_centers, n_ch, n_clus);
+    }
+
+    // Finding the closest centers of a block of pixels with the vectorized
+    // kernel, then adding each pixel to the sums of its center in the same
+    // pass, so the pixels are read once per iteration. Without the array of
+    // the distances, the distances of the block only feed the farthest pixels
+    // of the thread
+
+    #pragma omp for schedule(static) nowait
+    for (px = 0; px < n_px; px += DIST_BLOCK) {
+        n = n_px - px < DIST_BLOCK ? n_px - px : DIST_BLOCK;
+        out_dists = dists ? dists + px : blk_dists;
+
+        switch (precision) {
+            case PREC_FIXED:
+                nearest_centers_fixed(data + px * px_step, fx_centers, near, out_dists, n, n_ch, n_clus, plane);
+                break;
+            case PREC_FLOAT:
+                nearest_centers_float(data + px * px_step, f_centers, near, out_dists, n, n_ch, n_clus, plane);
+                break;
+            default:
+                nearest_centers(data + px * px_step, centers, near, out_dists, n, n_ch, n_clus, plane);
+                break;
+        }
+
+        SPECIALIZE_LABELS(l_size, SPECIALIZE_CH(n_ch, changed = accumulate_pixels(data + px * px_step, weights ? weights + px : NULL, near, (char *)labels + (size_t)px * L_SIZE, thr_sums, thr_counts, n, N_CH, px_step, ch_step, incremental, L_SIZE)));
 
-            max_dist = 0;
+        tmp_changes += changed;
 
-            for (px = 0; px < n_px; px++) {
-                if (dists[px] > max_dist) {
-                    max_dist = dists[px];
-                    far_px = px;
+        if (!dists) {
+            for (i = 0; i < n; i++) {
+                if (FAR_KEEPS(thr_dists, thr_far, n_clus, blk_dists[i])) {
+                    thr_far = far_push(thr_dists, thr_idx, thr_far, n_clus, blk_dists[i], px + i);
                 }
             }
+        }
+    }
+
+    merge_accums(sums, counts, n_ch, n_clus);
+
+    #pragma omp atomic
+    *changes += tmp_changes;
+
+    // The merge keeps the same pixels for any split among the threads
+
+    if (!dists) {
+        #pragma omp critical
+        *n_far = far_merge(far_dists, far_idx, *n_far, thr_dists, thr_idx, thr_far, n_clus);
+    }
+
+    #pragma omp barrier
+
+    if (!dists) {
+        #pragma omp single
+        far_sort(far_dists, far_idx, *n_far);
+    }
+}
+
+KERNEL_INLINE int accumulate_pixels(byte_t *data, int *weights, int *near, void *labels, double *sums, int *counts, int n_px, int n_ch, int px_step, int ch_step, int incremental, int l_size)
+{
+    int px, ch;
+    int min_k, old_k, weight, changed = 0;
+
+    // Storing the new labels of a block of pixels and adding the pixels to
+    // the sums of their centers
 
+    for (px = 0; px < n_px; px++) {
+        min_k = near[px];
+        old_k = GET_LABEL(labels, px, l_size);
+        weight = weights ? weights[px] : 1;
+
+        if (old_k != min_k) {
+            SET_LABEL(labels, px, l_size, min_k);
+            changed += weight;
+        } else if (incremental) {
+            continue;
+        }
+
+        // In incremental mode the sums still hold the previous assignment, so
+        // only the pixels changing center are moved from the old one to the new
+
+        if (incremental) {
             for (ch = 0; ch < n_ch; ch++) {
-                centers[k * n_ch + ch] = data[far_px * n_ch + ch];
+                sums[old_k * n_ch + ch] -= (double)weight * data[px * px_step + ch * ch_step];
             }
 
-            dists[far_px] = 0;
+            counts[old_k] -= weight;
+        }
+
+        for (ch = 0; ch < n_ch; ch++) {
+            sums[min_k * n_ch + ch] += (double)weight * data[px * px_step + ch * ch_step];
         }
+
+        counts[min_k] += weight;
     }
 
-    free(counts);
+    return changed;
 }
 
-void update_data(byte_t *data, double *centers, int *labels, int n_px, int n_ch)
+void update_centers(byte_t *data, double *centers, double *sums, int *counts, double *dists, double *far_dists, int *far_idx, int *n_far, int n_px, int n_ch, int n_clus)
 {
-    int px, ch, min_k;
+    int ch, k;
+    int far_px, n_empty = 0, n_used = 0;
 
-    #pragma omp parallel for schedule(static) private(px, ch, min_k)
-    for (px = 0; px < n_px; px++) {
-        min_k = labels[px];
+    // When the distances of all the pixels are kept, the farthest pixels
+    // needed by the empty clusters are found together in a single pass
 
-        for (ch = 0; ch < n_ch; ch++) {
-            data[px * n_ch + ch] = (byte_t)round(centers[min_k * n_ch + ch]);
+    if (dists) {
+        for (k = 0; k < n_clus; k++) {
+            if (!counts[k]) {
+                n_empty++;
+            }
+        }
+
+        if (n_empty) {
+            find_farthest(dists, far_dists, far_idx, n_far, n_px, n_empty);
+        }
+    }
+
+    // Dividing the sums accumulated by the assignment to obtain the centers
+    // mean, in a single thread as the empty clusters take the pixels in order
+
+    #pragma omp single
+    {
+        for (k = 0; k < n_clus; k++) {
+            if (counts[k]) {
+                for (ch = 0; ch < n_ch; ch++) {
+                    centers[k * n_ch + ch] = sums[k * n_ch + ch] / counts[k];
+                }
+            } else {
+                // If the cluster is empty we take the farthest pixel from its
+                // cluster center not taken yet by another empty cluster
+
+                far_px = n_used < *n_far ? far_idx[n_used++] : 0;
+
+                for (ch = 0; ch < n_ch; ch++) {
+                    centers[k * n_ch + ch] = data[far_px * n_ch + ch];
+                }
+            }
         }
     }
 }
 
-void compute_sse(double *sse, double *dists, int n_px)
+void find_farthest(double *dists, double *far_dists, int *far_idx, int *n_far, int n_px, int max_far)
 {
     int px;
-    double res = 0;
+    int thr_far = 0, *thr_idx;
+    double *thr_dists;
+
+    thr_dists = malloc(max_far * sizeof(double));
+    thr_idx = malloc(max_far * sizeof(int));
+
+    #pragma omp single
+    *n_far = 0;
+
+    // Each thread keeps the farthest pixels of its share, then the merge
+    // keeps the same pixels for any split among the threads
 
-    #pragma omp parallel for private(px) reduction(+:res)
+    #pragma omp for schedule(static) nowait
     for (px = 0; px < n_px; px++) {
-        res += dists[px];
+        if (FAR_KEEPS(thr_dists, thr_far, max_far, dists[px])) {
+            thr_far = far_push(thr_dists, thr_idx, thr_far, max_far, dists[px], px);
+        }
     }
 
-    *sse = res;
+    #pragma omp critical
+    *n_far = far_merge(far_dists, far_idx, *n_far, thr_dists, thr_idx, thr_far, max_far);
+
+    #pragma omp barrier
+    #pragma omp single
+    far_sort(far_dists, far_idx, *n_far);
+
+    free(thr_dists);
+    free(thr_idx);
+}
+
+int tune_threads(byte_t *data, double *centers, int n_px, int n_ch, int n_clus)
+{
+    int t, p, n_cpus, size_class, changes, n_far = 0;
+    int best_threads, l_size, *counts, *far_idx;
+    long long work;
+    void *labels, *scratch;
+    double start, time, best_time = 0;
+    double *sums, *far_dists;
+
+    n_cpus = omp_get_num_procs();
+    work = (long long)n_px * n_clus * n_ch;
+
+    // Large images keep all the CPUs busy, and a calibration run would cost
+    // as much as the time it could save
+
+    if (work >= TUNE_MAX_WORK) {
+        return n_cpus;
+    }
+
+    size_class = tune_size_class(work);
+    best_threads = tune_cache_load(n_cpus, size_class);
+
+    if (best_threads > 0 && best_threads <= n_cpus) {
+        return best_threads;
+    }
+
+    // Timing a few assignment passes of the points with a doubling number of
+    // threads, which stops as soon as more threads do not help anymore
+
+    omp_set_num_threads(n_cpus);
+
+    l_size = LABEL_SIZE(n_clus);
+    labels = malloc((size_t)n_px * l_size);
+    memset(labels, LABEL_NONE, (size_t)n_px * l_size);
+    sums = alloc_sums(n_ch, n_clus);
+    counts = alloc_counts(n_clus);
+    scratch = alloc_scratch(ASSIGN_SCRATCH(n_clus));
+    far_dists = malloc(n_clus * sizeof(double));
+    far_idx = malloc(n_clus * sizeof(int));
+
+    for (t = 1; ; t = t * 2 < n_cpus ? t * 2 : n_cpus) {
+        start = omp_get_wtime();
+
+        #pragma omp parallel num_threads(t) private(p)
+        {
+            for (p = 0; p < TUNE_PASSES; p++) {
+                assign_pixels(data, NULL, centers, labels, NULL, far_dists, far_idx, &n_far, sums, counts, scratch, &changes, n_px, n_ch, n_clus, PREC_DOUBLE, 0, 0, l_size);
+            }
+        }
+
+        time = omp_get_wtime() - start;
+
+        if (t > 1 && time >= best_time) {
+            break;
+        }
+
+        best_time = time;
+        best_threads = t;
+
+        if (t == n_cpus) {
+            break;
+        }
+    }
+
+    tune_cache_save(n_cpus, size_class, best_threads);
+
+    free(labels);
+    free(sums);
+    free(counts);
+    free(scratch);
+    free(far_dists);
+    free(far_idx);
+
+    return best_threads;
+}
+
+void pin_threads(int pin)
+{
+    int i, cpu, thr, n_thr, n_cpus;
+    int *cpus;
+    cpu_set_t set;
+
+    // Listing the CPUs the process is allowed to run on
+
+    sched_getaffinity(0, sizeof(set), &set);
+    n_cpus = CPU_COUNT(&set);
+    cpus = malloc(n_cpus * sizeof(int));
+
+    for (cpu = 0, i = 0; cpu < CPU_SETSIZE && i < n_cpus; cpu++) {
+        if (CPU_ISSET(cpu, &set)) {
+            cpus[i++] = cpu;
+        }
+    }
+
+    // Binding each thread of the team to a single CPU, either the consecutive
+    // ones (close) or evenly spaced ones (spread), which on machines numbering
+    // the CPUs by socket puts threads on all the sockets. The threads of the
+    // following parallel regions are the same, so the binding persists
+
+    #pragma omp parallel private(i, thr, n_thr, set)
+    {
+        thr = omp_get_thread_num();
+        n_thr = omp_get_num_threads();
+        i = pin == PIN_SPREAD ? (long long)thr * n_cpus / n_thr : thr % n_cpus;
+
+        CPU_ZERO(&set);
+        CPU_SET(cpus[i], &set);
+        sched_setaffinity(0, sizeof(set), &set);
+    }
+
+    free(cpus);
+}
+
+byte_t *copy_pixels(byte_t *data, int n_px, int n_ch)
+{
+    int px;
+    byte_t *copy;
+
+    copy = malloc((size_t)n_px * n_ch * sizeof(byte_t));
+
+    #pragma omp parallel for schedule(static) private(px)
+    for (px = 0; px < n_px; px++) {
+        memcpy(copy + (size_t)px * n_ch, data + (size_t)px * n_ch, n_ch);
+    }
+
+    return copy;
+}
+
+void touch_pixels(void *buf, int n_px, size_t px_size, int value)
+{
+    int px;
+
+    // Filling the buffer with the schedule of the assignment, so that the
+    // first touch maps each page on the node of the thread that uses it
+
+    #pragma omp parallel for schedule(static) private(px)
+    for (px = 0; px < n_px; px++) {
+        memset((char *)buf + px * px_size, value, px_size);
+    }
+}
+
+double *alloc_sums(int n_ch, int n_clus)
+{
+    return aligned_alloc(CACHE_LINE, omp_get_max_threads() * SUMS_STRIDE(n_ch, n_clus) * sizeof(double));
+}
+
+int *alloc_counts(int n_clus)
+{
+    return aligned_alloc(CACHE_LINE, omp_get_max_threads() * COUNTS_STRIDE(n_clus) * sizeof(int));
+}
+
+void *alloc_scratch(size_t size)
+{
+    return aligned_alloc(CACHE_LINE, omp_get_max_threads() * PAD_TO_LINE(size, 1));
+}
+
+void reset_accums(double *sums, int *counts, int n_ch, int n_clus, int incremental)
+{
+    // Each thread clears its own copy, so no thread waits for the others. In
+    // incremental mode the first copy keeps the merged sums of the previous
+    // iteration, and the other copies only receive the changes
+
+    if (incremental && omp_get_thread_num() == 0) {
+        return;
+    }
+
+    memset(THR_SUMS(sums, n_ch, n_clus), 0, n_clus * n_ch * sizeof(double));
+    memset(THR_COUNTS(counts, n_clus), 0, n_clus * sizeof(int));
+}
+
+void merge_accums(double *sums, int *counts, int n_ch, int n_clus)
+{
+    int i, k, ch, t, step, thr, n_thr;
+    size_t sums_stride, counts_stride;
+
+    n_thr = omp_get_num_threads();
+    thr = omp_get_thread_num();
+    sums_stride = SUMS_STRIDE(n_ch, n_clus);
+    counts_stride = COUNTS_STRIDE(n_clus);
+
+    // Waiting for all the threads to finish their copies
+
+    #pragma omp barrier
+
+    if (n_thr <= ACCUM_TREE_THREADS) {
+        // The centers are split among the threads, each adding the copies of
+        // its centers into the first one
+
+        #pragma omp for schedule(static)
+        for (k = 0; k < n_clus; k++) {
+            for (t = 1; t < n_thr; t++) {
+                for (ch = 0; ch < n_ch; ch++) {
+                    sums[k * n_ch + ch] += sums[t * sums_stride + k * n_ch + ch];
+                }
+
+                counts[k] += counts[t * counts_stride + k];
+            }
+        }
+    } else {
+        // With many threads the copies are merged in pairs, halving their
+        // number at each round, so that the merge takes log2(n_thr) rounds
+
+        for (step = 1; step < n_thr; step *= 2) {
+            if (thr % (2 * step) == 0 && thr + step < n_thr) {
+                for (i = 0; i < n_clus * n_ch; i++) {
+                    sums[thr * sums_stride + i] += sums[(thr + step) * sums_stride + i];
+                }
+
+                for (k = 0; k < n_clus; k++) {
+                    counts[thr * counts_stride + k] += counts[(thr + step) * counts_stride + k];
+                }
+            }
+
+            #pragma omp barrier
+        }
+    }
+}
+
+void update_data(byte_t *data, double *centers, void *labels, int *px_map, int n_px, int n_ch, int l_size)
+{
+    SPECIALIZE_LABELS(l_size, SPECIALIZE_CH(n_ch, update_data_ch(data, centers, labels, px_map, n_px, N_CH, L_SIZE)));
+}
+
+KERNEL_INLINE void update_data_ch(byte_t *data, double *centers, void *labels, int *px_map, int n_px, int n_ch, int l_size)
+{
+    int px, ch, min_k;
+
+    #pragma omp parallel for schedule(static) private(px, ch, min_k)
+    for (px = 0; px < n_px; px++) {
+        min_k = px_map ? GET_LABEL(labels, px_map[px], l_size) : GET_LABEL(labels, px, l_size);
+
+        for (ch = 0; ch < n_ch; ch++) {
+            data[px * n_ch + ch] = (byte_t)round(centers[min_k * n_ch + ch]);
+        }
+    }
+}
+
+void to_planar(byte_t *data, byte_t *planes, int n_px, int n_ch)
+{
+    int px, ch;
+
+    // Splitting the interleaved channels in one contiguous plane each
+
+    #pragma omp parallel for schedule(static) private(px, ch)
+    for (px = 0; px < n_px; px++) {
+        for (ch = 0; ch < n_ch; ch++) {
+            planes[(size_t)ch * n_px + px] = data[px * n_ch + ch];
+        }
+    }
+}
+
+void compute_sse(byte_t *data, int *weights, double *centers, void *labels, int *px_map, double *sse, int n_px, int n_ch, int n_clus, int l_size)
+{
+    int px, ch, k;
+    int min_k, weight;
+    long long *sums, *sq_sums, *counts;
+    double res = 0, center;
+
+    sums = calloc(n_clus * n_ch, sizeof(long long));
+    sq_sums = calloc(n_clus, sizeof(long long));
+    counts = calloc(n_clus, sizeof(long long));
+
+    // Accumulating the integer moments of each cluster, which are exact and
+    // then do not depend on the order of the sum
+
+    #pragma omp parallel for private(px, ch, min_k, weight) reduction(+:sums[:n_clus * n_ch],sq_sums[:n_clus],counts[:n_clus])
+    for (px = 0; px < n_px; px++) {
+        min_k = px_map ? GET_LABEL(labels, px_map[px], l_size) : GET_LABEL(labels, px, l_size);
+        weight = weights ? weights[px] : 1;
+
+        for (ch = 0; ch < n_ch; ch++) {
+            sums[min_k * n_ch + ch] += (long long)weight * data[px * n_ch + ch];
+            sq_sums[min_k] += (long long)weight * data[px * n_ch + ch] * data[px * n_ch + ch];
+        }
+
+        counts[min_k] += weight;
+    }
+
+    // Expanding the squared distances from the centers in terms of the moments
+
+    for (k = 0; k < n_clus; k++) {
+        res += sq_sums[k];
+
+        for (ch = 0; ch < n_ch; ch++) {
+            center = centers[k * n_ch + ch];
+            res += center * (counts[k] * center - 2 * sums[k * n_ch + ch]);
+        }
+    }
+
+    *sse = res;
+
+    free(sums);
+    free(sq_sums);
+    free(counts);
+}
+
+long long sum_squares(byte_t *data, int *weights, int n_px, int n_ch)
+{
+    int px, ch, weight;
+    long long total = 0;
+
+    // Sum of the squared channels of all the pixels, which does not depend
+    // on the clusters and is computed once
+
+    #pragma omp parallel for schedule(static) private(px, ch, weight) reduction(+:total)
+    for (px = 0; px < n_px; px++) {
+        weight = weights ? weights[px] : 1;
+
+        for (ch = 0; ch < n_ch; ch++) {
+            total += (long long)weight * data[px * n_ch + ch] * data[px * n_ch + ch];
+        }
+    }
+
+    return total;
+}
+
+int check_stop(double *sums, int *counts, double *drifts, double *prev_sse, long long sq_total, int changes, int n_px, int n_ch, int n_clus, int iter, segm_params_t *params)
+{
+    int k, ch;
+    double iter_sse, max_drift = 0;
+
+    // The fraction of changed pixels and the SSE are only known when all the
+    // pixels are assigned at each iteration, which mini-batch does not do
+
+    if (params->algo != ALGO_MINIBATCH) {
+        if (changes <= params->tol_changes * n_px) {
+            return STOP_CHANGES;
+        }
+
+        if (params->tol_sse > 0) {
+            // The SSE of the clusters around their means follows from the sums
+            // accumulated for the update and the squares of the pixels
+
+            iter_sse = sq_total;
+
+            for (k = 0; k < n_clus; k++) {
+                for (ch = 0; ch < n_ch && counts[k]; ch++) {
+                    iter_sse -= sums[k * n_ch + ch] * sums[k * n_ch + ch] / counts[k];
+                }
+            }
+
+            if (iter && *prev_sse - iter_sse <= params->tol_sse * *prev_sse) {
+                return STOP_SSE;
+            }
+
+            *prev_sse = iter_sse;
+        }
+    }
+
+    if (params->tol_shift > 0) {
+        for (k = 0; k < n_clus; k++) {
+            if (drifts[k] > max_drift) {
+                max_drift = drifts[k];
+            }
+        }
+
+        if (max_drift <= params->tol_shift) {
+            return STOP_SHIFT;
+        }
+    }
+
+    return STOP_NONE;
+}
+
+int check_deadline(double start_time, double *iter_start, double final_time, double deadline)
+{
+    double now, iter_time;
+
+    now = omp_get_wtime();
+    iter_time = now - *iter_start;
+    *iter_start = now;
+
+    // Another iteration starts only if it still fits in the budget with the
+    // final pass over the pixels. Both are estimated by the last iteration, as
+    // the first ones of the bounded algorithms are much slower, and the final
+    // pass by the estimate of the caller when it is longer. Stopping here
+    // keeps the centers just updated from the labels, the best result reached
+
+    if (final_time < iter_time) {
+        final_time = iter_time;
+    }
+
+    if (now - start_time + iter_time + final_time > deadline) {
+        return STOP_DEADLINE;
+    }
+
+    return STOP_NONE;
+}
+
+int reduce_unique(byte_t *data, byte_t **pts, int **weights, int *px_map, int n_px, int n_ch)
+{
+    int px, ch, i, j, t, pass, n_pts;
+    int n_thr, thr, lo, hi;
+    int *hist, *starts, *order, *tmp_order, *swap_order;
+    unsigned int *keys, *tmp_keys, *swap_keys;
+
+    keys = malloc(n_px * sizeof(unsigned int));
+    tmp_keys = malloc(n_px * sizeof(unsigned int));
+    order = malloc(n_px * sizeof(int));
+    tmp_order = malloc(n_px * sizeof(int));
+    hist = malloc(omp_get_max_threads() * 256 * sizeof(int));
+
+    // Every thread sorts and scans its own contiguous chunk, so the resulting
+    // table does not depend on the number of threads
+
+    #pragma omp parallel private(px, ch, i, j, t, pass, n_thr, thr, lo, hi)
+    {
+        n_thr = omp_get_num_threads();
+        thr = omp_get_thread_num();
+        lo = (long long)n_px * thr / n_thr;
+        hi = (long long)n_px * (thr + 1) / n_thr;
+
+        // Packing the channels of each pixel in a single key
+
+        for (px = lo; px < hi; px++) {
+            keys[px] = 0;
+
+            for (ch = 0; ch < n_ch; ch++) {
+                keys[px] = keys[px] << 8 | data[px * n_ch + ch];
+            }
+
+            order[px] = px;
+        }
+
+        // Sorting the keys one byte at a time with a stable counting sort,
+        // using a histogram per thread
+
+        for (pass = 0; pass < n_ch; pass++) {
+            memset(hist + thr * 256, 0, 256 * sizeof(int));
+
+            for (i = lo; i < hi; i++) {
+                hist[thr * 256 + (keys[i] >> (8 * pass) & 0xFF)]++;
+            }
+
+            #pragma omp barrier
+            #pragma omp single
+            {
+                for (j = 0, i = 0; j < 256; j++) {
+                    for (t = 0; t < n_thr; t++) {
+                        px = hist[t * 256 + j];
+                        hist[t * 256 + j] = i;
+                        i += px;
+                    }
+                }
+            }
+
+            for (i = lo; i < hi; i++) {
+                j = hist[thr * 256 + (keys[i] >> (8 * pass) & 0xFF)]++;
+                tmp_keys[j] = keys[i];
+                tmp_order[j] = order[i];
+            }
+
+            #pragma omp barrier
+            #pragma omp single
+            {
+                swap_keys = keys, keys = tmp_keys, tmp_keys = swap_keys;
+                swap_order = order, order = tmp_order, tmp_order = swap_order;
+            }
+        }
+
+        // Counting the runs of equal keys starting in each chunk
+
+        hist[thr] = 0;
+
+        for (i = lo; i < hi; i++) {
+            if (i == 0 || keys[i] != keys[i - 1]) {
+                hist[thr]++;
+            }
+        }
+
+        #pragma omp barrier
+        #pragma omp single
+        {
+            for (t = 0, n_pts = 0; t < n_thr; t++) {
+                px = hist[t];
+                hist[t] = n_pts;
+                n_pts += px;
+            }
+
+            *pts = malloc(n_pts * n_ch * sizeof(byte_t));
+            *weights = malloc(n_pts * sizeof(int));
+            starts = malloc((n_pts + 1) * sizeof(int));
+            starts[n_pts] = n_px;
+        }
+
+        // Collecting each run as a color whose weight is the run length
+
+        for (i = lo, j = hist[thr] - 1; i < hi; i++) {
+            if (i == 0 || keys[i] != keys[i - 1]) {
+                j++;
+                starts[j] = i;
+                memcpy(*pts + j * n_ch, data + order[i] * n_ch, n_ch);
+            }
+
+            px_map[order[i]] = j;
+        }
+
+        #pragma omp barrier
+        #pragma omp for schedule(static)
+        for (j = 0; j < n_pts; j++) {
+            (*weights)[j] = starts[j + 1] - starts[j];
+        }
+    }
+
+    free(keys);
+    free(tmp_keys);
+    free(order);
+    free(tmp_order);
+    free(hist);
+    free(starts);
+
+    return n_pts;
+}
+
+int reduce_hist(byte_t *data, byte_t **pts, int **weights, int *px_map, int n_px, int n_ch, int bits)
+{
+    int px, ch, bin, n_bins, n_pts, run_bin, run_count;
+    int *counts, *bin_map;
+    long long *sums, run_sums[DIST_MAX_CH];
+
+    // Limiting the size of the histogram for images with many channels
+
+    if (bits * n_ch > HIST_MAX_BITS) {
+        bits = HIST_MAX_BITS / n_ch;
+    }
+
+    n_bins = 1 << (bits * n_ch);
+
+    counts = calloc(n_bins, sizeof(int));
+    sums = calloc(n_bins * n_ch, sizeof(long long));
+    bin_map = malloc(n_bins * sizeof(int));
+
+    // Accumulating the pixels falling in each bin, identified by the most
+    // significant bits of the channels. The histogram is too large to be
+    // copied for every thread, so the threads share it with atomic updates.
+    // Neighboring pixels mostly fall in the same bin, so each thread gathers
+    // the runs of pixels of a bin and adds them at once, which keeps the
+    // atomics few and the contention on the bins of flat regions low
+
+    #pragma omp parallel private(px, ch, bin, run_bin, run_count, run_sums)
+    {
+        run_bin = 0;
+        run_count = 0;
+
+        #pragma omp for schedule(static) nowait
+        for (px = 0; px < n_px; px++) {
+            bin = 0;
+
+            for (ch = 0; ch < n_ch; ch++) {
+                bin = bin << bits | data[px * n_ch + ch] >> (8 - bits);
+            }
+
+            if (bin != run_bin || !run_count) {
+                add_hist_run(counts, sums, run_bin, run_count, run_sums, n_ch);
+                run_bin = bin;
+                run_count = 0;
+
+                for (ch = 0; ch < n_ch; ch++) {
+                    run_sums[ch] = 0;
+                }
+            }
+
+            for (ch = 0; ch < n_ch; ch++) {
+                run_sums[ch] += data[px * n_ch + ch];
+            }
+
+            run_count++;
+        }
+
+        add_hist_run(counts, sums, run_bin, run_count, run_sums, n_ch);
+    }
+
+    // Each non-empty bin becomes a color placed in the centroid of its pixels
+
+    n_pts = 0;
+
+    for (bin = 0; bin < n_bins; bin++) {
+        bin_map[bin] = counts[bin] ? n_pts++ : -1;
+    }
+
+    *pts = malloc(n_pts * n_ch * sizeof(byte_t));
+    *weights = malloc(n_pts * sizeof(int));
+
+    for (bin = 0; bin < n_bins; bin++) {
+        if (counts[bin]) {
+            for (ch = 0; ch < n_ch; ch++) {
+                (*pts)[bin_map[bin] * n_ch + ch] = (sums[bin * n_ch + ch] + counts[bin] / 2) / counts[bin];
+            }
+
+            (*weights)[bin_map[bin]] = counts[bin];
+        }
+    }
+
+    // Mapping the pixels to the colors of their bins
+
+    #pragma omp parallel for schedule(static) private(px, ch, bin)
+    for (px = 0; px < n_px; px++) {
+        bin = 0;
+
+        for (ch = 0; ch < n_ch; ch++) {
+            bin = bin << bits | data[px * n_ch + ch] >> (8 - bits);
+        }
+
+        px_map[px] = bin_map[bin];
+    }
+
+    free(counts);
+    free(sums);
+    free(bin_map);
+
+    return n_pts;
+}
+
+void add_hist_run(int *counts, long long *sums, int bin, int count, long long *run_sums, int n_ch)
+{
+    int ch;
+
+    if (!count) {
+        return;
+    }
+
+    for (ch = 0; ch < n_ch; ch++) {
+        #pragma omp atomic
+        sums[bin * n_ch + ch] += run_sums[ch];
+    }
+
+    #pragma omp atomic
+    counts[bin] += count;
+}
+
+void compute_drifts(double *old_centers, double *centers, double *drifts, int n_ch, int n_clus)
+{
+    int k;
+
+    #pragma omp for schedule(static)
+    for (k = 0; k < n_clus; k++) {
+        drifts[k] = center_dist(old_centers + k * n_ch, centers + k * n_ch, n_ch);
+    }
+}
+
+void compute_center_dists(double *centers, double *c_dists, double *s, int n_ch, int n_clus)
+{
+    int k, j;
+
+    // Computing the distances between centers and half the distance of each
+    // center from its nearest one
+
+    #pragma omp for schedule(static)
+    for (k = 0; k < n_clus; k++) {
+        s[k] = DBL_MAX;
+
+        for (j = 0; j < n_clus; j++) {
+            c_dists[k * n_clus + j] = center_dist(centers + k * n_ch, centers + j * n_ch, n_ch);
+
+            if (j != k && c_dists[k * n_clus + j] < s[k]) {
+                s[k] = c_dists[k * n_clus + j];
+            }
+        }
+
+        s[k] *= 0.5;
+    }
+}
+
+void assign_pixels_elkan(byte_t *data, int *weights, double *centers, void *labels, double *sums, int *counts, double *upper, double *lower, double *c_dists, double *s, int *changes, long long *n_dists, int n_px, int n_ch, int n_clus, int first, int incremental, int l_size)
+{
+    int px, ch, k;
+    int min_k, old_k, stale, weight, tmp_changes = 0;
+    int *thr_counts;
+    long long tmp_dists = 0;
+    double dist, min_dist, *px_lower, *thr_sums;
+
+    #pragma omp single
+    {
+        *changes = 0;
+        *n_dists = 0;
+    }
+
+    reset_accums(sums, counts, n_ch, n_clus, incremental);
+    thr_sums = THR_SUMS(sums, n_ch, n_clus);
+    thr_counts = THR_COUNTS(counts, n_clus);
+
+    if (first) {
+        // Without valid bounds every distance has to be computed once
+
+        #pragma omp for schedule(static) nowait
+        for (px = 0; px < n_px; px++) {
+            px_lower = lower + (size_t)px * n_clus;
+            min_dist = DBL_MAX;
+            min_k = 0;
+
+            for (k = 0; k < n_clus; k++) {
+                dist = px_dist(data + px * n_ch, centers + k * n_ch, n_ch);
+                px_lower[k] = dist;
+                tmp_dists++;
+
+                if (dist < min_dist) {
+                    min_dist = dist;
+                    min_k = k;
+                }
+            }
+
+            upper[px] = min_dist;
+            SET_LABEL(labels, px, l_size, min_k);
+
+            weight = weights ? weights[px] : 1;
+            tmp_changes += weight;
+
+            for (ch = 0; ch < n_ch; ch++) {
+                thr_sums[min_k * n_ch + ch] += (double)weight * data[px * n_ch + ch];
+            }
+
+            thr_counts[min_k] += weight;
+        }
+
+        merge_accums(sums, counts, n_ch, n_clus);
+
+        #pragma omp atomic
+        *changes += tmp_changes;
+
+        #pragma omp single
+        *n_dists = (long long)n_px * n_clus;
+
+        return;
+    }
+
+    compute_center_dists(centers, c_dists, s, n_ch, n_clus);
+
+    #pragma omp for schedule(static) nowait
+    for (px = 0; px < n_px; px++) {
+        px_lower = lower + (size_t)px * n_clus;
+        min_k = GET_LABEL(labels, px, l_size);
+        min_dist = upper[px];
+
+        // If the pixel is closer to its center than half the distance of the
+        // center from any other one, the assignment cannot change
+
+        if (min_dist > s[min_k]) {
+            stale = 1;
+
+            for (k = 0; k < n_clus; k++) {
+                if (k == min_k || min_dist <= px_lower[k] || min_dist <= 0.5 * c_dists[min_k * n_clus + k]) {
+                    continue;
+                }
+
+                // Tightening the upper bound before computing other distances
+
+                if (stale) {
+                    min_dist = px_dist(data + px * n_ch, centers + min_k * n_ch, n_ch);
+                    px_lower[min_k] = min_dist;
+                    stale = 0;
+                    tmp_dists++;
+
+                    if (min_dist <= px_lower[k] || min_dist <= 0.5 * c_dists[min_k * n_clus + k]) {
+                        continue;
+                    }
+                }
+
+                dist = px_dist(data + px * n_ch, centers + k * n_ch, n_ch);
+                px_lower[k] = dist;
+                tmp_dists++;
+
+                if (dist < min_dist) {
+                    min_dist = dist;
+                    min_k = k;
+                }
+            }
+
+            upper[px] = min_dist;
+        }
+
+        old_k = GET_LABEL(labels, px, l_size);
+        weight = weights ? weights[px] : 1;
+
+        if (old_k != min_k) {
+            SET_LABEL(labels, px, l_size, min_k);
+            tmp_changes += weight;
+        } else if (incremental) {
+            continue;
+        }
+
+        if (incremental) {
+            for (ch = 0; ch < n_ch; ch++) {
+                thr_sums[old_k * n_ch + ch] -= (double)weight * data[px * n_ch + ch];
+            }
+
+            thr_counts[old_k] -= weight;
+        }
+
+        for (ch = 0; ch < n_ch; ch++) {
+            thr_sums[min_k * n_ch + ch] += (double)weight * data[px * n_ch + ch];
+        }
+
+        thr_counts[min_k] += weight;
+    }
+
+    merge_accums(sums, counts, n_ch, n_clus);
+
+    #pragma omp atomic
+    *changes += tmp_changes;
+
+    #pragma omp atomic
+    *n_dists += tmp_dists;
+
+    #pragma omp barrier
+}
+
+void update_bounds_elkan(void *labels, double *upper, double *lower, double *drifts, int n_px, int n_clus, int l_size)
+{
+    int px, k;
+    double *px_lower;
+
+    #pragma omp for schedule(static)
+    for (px = 0; px < n_px; px++) {
+        px_lower = lower + (size_t)px * n_clus;
+
+        for (k = 0; k < n_clus; k++) {
+            px_lower[k] = px_lower[k] > drifts[k] ? px_lower[k] - drifts[k] : 0;
+        }
+
+        upper[px] += drifts[GET_LABEL(labels, px, l_size)];
+    }
+}
+
+void assign_pixels_hamerly(byte_t *data, int *weights, double *centers, void *labels, double *sums, int *counts, double *upper, double *lower, double *c_dists, double *s, int *changes, long long *n_dists, int n_px, int n_ch, int n_clus, int first, int incremental, int l_size)
+{
+    int px, ch, k;
+    int min_k, old_k, scan, weight, tmp_changes = 0;
+    int *thr_counts;
+    long long tmp_dists = 0;
+    double dist, min_dist, sec_dist, bound, *thr_sums;
+
+    #pragma omp single
+    {
+        *changes = 0;
+        *n_dists = 0;
+    }
+
+    reset_accums(sums, counts, n_ch, n_clus, incremental);
+    thr_sums = THR_SUMS(sums, n_ch, n_clus);
+    thr_counts = THR_COUNTS(counts, n_clus);
+
+    if (!first) {
+        compute_center_dists(centers, c_dists, s, n_ch, n_clus);
+    }
+
+    #pragma omp for schedule(static) nowait
+    for (px = 0; px < n_px; px++) {
+        min_k = GET_LABEL(labels, px, l_size);
+        scan = 1;
+
+        if (!first) {
+            // The assignment cannot change if the upper bound does not exceed
+            // both the lower bound and half the distance to the nearest center
+
+            bound = lower[px] > s[min_k] ? lower[px] : s[min_k];
+
+            if (upper[px] > bound) {
+                upper[px] = px_dist(data + px * n_ch, centers + min_k * n_ch, n_ch);
+                tmp_dists++;
+            }
+
+            scan = upper[px] > bound;
+        }
+
+        if (scan) {
+            // Finding the two closest centers to refresh both bounds
+
+            min_dist = sec_dist = DBL_MAX;
+
+            for (k = 0; k < n_clus; k++) {
+                dist = px_dist(data + px * n_ch, centers + k * n_ch, n_ch);
+
+                if (dist < min_dist) {
+                    sec_dist = min_dist;
+                    min_dist = dist;
+                    min_k = k;
+                } else if (dist < sec_dist) {
+                    sec_dist = dist;
+                }
+            }
+
+            tmp_dists += n_clus;
+
+            upper[px] = min_dist;
+            lower[px] = sec_dist;
+        }
+
+        old_k = GET_LABEL(labels, px, l_size);
+        weight = weights ? weights[px] : 1;
+
+        if (first || old_k != min_k) {
+            SET_LABEL(labels, px, l_size, min_k);
+            tmp_changes += weight;
+        } else if (incremental) {
+            continue;
+        }
+
+        if (incremental) {
+            for (ch = 0; ch < n_ch; ch++) {
+                thr_sums[old_k * n_ch + ch] -= (double)weight * data[px * n_ch + ch];
+            }
+
+            thr_counts[old_k] -= weight;
+        }
+
+        for (ch = 0; ch < n_ch; ch++) {
+            thr_sums[min_k * n_ch + ch] += (double)weight * data[px * n_ch + ch];
+        }
+
+        thr_counts[min_k] += weight;
+    }
+
+    merge_accums(sums, counts, n_ch, n_clus);
+
+    #pragma omp atomic
+    *changes += tmp_changes;
+
+    #pragma omp atomic
+    *n_dists += tmp_dists;
+
+    #pragma omp barrier
+}
+
+void update_bounds_hamerly(void *labels, double *upper, double *lower, double *drifts, int n_px, int n_clus, int l_size)
+{
+    int px, k, max_k;
+    double max_drift, sec_drift;
+
+    // The lower bound of a pixel decreases by the largest drift among the
+    // centers it is not assigned to
+
+    max_k = 0;
+    max_drift = sec_drift = 0;
+
+    for (k = 0; k < n_clus; k++) {
+        if (drifts[k] > max_drift) {
+            sec_drift = max_drift;
+            max_drift = drifts[k];
+            max_k = k;
+        } else if (drifts[k] > sec_drift) {
+            sec_drift = drifts[k];
+        }
+    }
+
+    #pragma omp for schedule(static)
+    for (px = 0; px < n_px; px++) {
+        upper[px] += drifts[GET_LABEL(labels, px, l_size)];
+        lower[px] -= GET_LABEL(labels, px, l_size) == max_k ? sec_drift : max_drift;
+    }
+}
+
+void group_centers(double *centers, int *grp_start, int *grp_centers, int *grp_of, int n_ch, int n_clus, int n_grps)
+{
+    int g, k, ch, iter, min_g, max_g;
+    int *counts;
+    double dist, min_dist, *grp_means;
+
+    counts = malloc(n_grps * sizeof(int));
+    grp_means = malloc(n_grps * n_ch * sizeof(double));
+
+    // Clustering the initial centers in groups with a few k-means iterations
+
+    for (g = 0; g < n_grps; g++) {
+        for (ch = 0; ch < n_ch; ch++) {
+            grp_means[g * n_ch + ch] = centers[(g * n_clus / n_grps) * n_ch + ch];
+        }
+    }
+
+    for (iter = 0; iter < YINYANG_GROUP_ITERS; iter++) {
+        for (k = 0; k < n_clus; k++) {
+            min_dist = DBL_MAX;
+            min_g = 0;
+
+            for (g = 0; g < n_grps; g++) {
+                dist = center_dist(centers + k * n_ch, grp_means + g * n_ch, n_ch);
+
+                if (dist < min_dist) {
+                    min_dist = dist;
+                    min_g = g;
+                }
+            }
+
+            grp_of[k] = min_g;
+        }
+
+        for (g = 0; g < n_grps; g++) {
+            for (ch = 0; ch < n_ch; ch++) {
+                grp_means[g * n_ch + ch] = 0;
+            }
+
+            counts[g] = 0;
+        }
+
+        for (k = 0; k < n_clus; k++) {
+            for (ch = 0; ch < n_ch; ch++) {
+                grp_means[grp_of[k] * n_ch + ch] += centers[k * n_ch + ch];
+            }
+
+            counts[grp_of[k]]++;
+        }
+
+        for (g = 0; g < n_grps; g++) {
+            for (ch = 0; ch < n_ch; ch++) {
+                grp_means[g * n_ch + ch] /= counts[g] ? counts[g] : 1;
+            }
+        }
+    }
+
+    // Moving a center from the largest group into each empty one
+
+    for (g = 0; g < n_grps; g++) {
+        if (!counts[g]) {
+            max_g = 0;
+
+            for (min_g = 1; min_g < n_grps; min_g++) {
+                if (counts[min_g] > counts[max_g]) {
+                    max_g = min_g;
+                }
+            }
+
+            for (k = 0; grp_of[k] != max_g; k++);
+
+            grp_of[k] = g;
+            counts[max_g]--;
+            counts[g]++;
+        }
+    }
+
+    // Listing the centers of each group contiguously
+
+    grp_start[0] = 0;
+
+    for (g = 0; g < n_grps; g++) {
+        grp_start[g + 1] = grp_start[g] + counts[g];
+        counts[g] = grp_start[g];
+    }
+
+    for (k = 0; k < n_clus; k++) {
+        grp_centers[counts[grp_of[k]]++] = k;
+    }
+
+    free(counts);
+    free(grp_means);
+}
+
+void assign_pixels_yinyang(byte_t *data, int *weights, double *centers, void *labels, double *sums, int *counts, double *upper, double *lower, int *grp_start, int *grp_centers, int *grp_of, void *scratch, int *changes, long long *n_dists, int n_px, int n_ch, int n_clus, int n_grps, int first, int incremental, int l_size)
+{
+    int px, ch, g, i, k;
+    int min_k, old_k, scan, weight, tmp_changes = 0;
+    int *grp_best, *thr_counts;
+    long long tmp_dists = 0;
+    double dist, min_dist, old_dist, glob_lower, *px_lower;
+    double *grp_min, *grp_sec, *thr_sums;
+    char *thr_scratch;
+
+    #pragma omp single
+    {
+        *changes = 0;
+        *n_dists = 0;
+    }
+
+    reset_accums(sums, counts, n_ch, n_clus, incremental);
+    thr_sums = THR_SUMS(sums, n_ch, n_clus);
+    thr_counts = THR_COUNTS(counts, n_clus);
+
+    // Each thread keeps the closest centers found in the groups it scans
+
+    thr_scratch = THR_SCRATCH(scratch, YINYANG_SCRATCH(n_grps));
+    grp_min = (double *)thr_scratch;
+    grp_sec = grp_min + n_grps;
+    grp_best = (int *)(grp_sec + n_grps);
+
+    #pragma omp for schedule(static) nowait
+    for (px = 0; px < n_px; px++) {
+        px_lower = lower + (size_t)px * n_grps;
+        old_k = min_k = GET_LABEL(labels, px, l_size);
+        old_dist = min_dist = DBL_MAX;
+        scan = 1;
+
+        if (!first) {
+            // The assignment cannot change if the upper bound does not exceed the
+            // lower bounds of all the groups
+
+            glob_lower = DBL_MAX;
+
+            for (g = 0; g < n_grps; g++) {
+                if (px_lower[g] < glob_lower) {
+                    glob_lower = px_lower[g];
+                }
+            }
+
+            if (upper[px] > glob_lower) {
+                upper[px] = px_dist(data + px * n_ch, centers + min_k * n_ch, n_ch);
+                tmp_dists++;
+            }
+
+            scan = upper[px] > glob_lower;
+            old_dist = min_dist = upper[px];
+        }
+
+        if (scan) {
+            // Scanning only the groups whose lower bound is below the best distance
+
+            for (g = 0; g < n_grps; g++) {
+                grp_best[g] = -1;
+
+                if (!first && px_lower[g] >= min_dist) {
+                    continue;
+                }
+
+                grp_min[g] = grp_sec[g] = DBL_MAX;
+
+                for (i = grp_start[g]; i < grp_start[g + 1]; i++) {
+                    k = grp_centers[i];
+                    dist = px_dist(data + px * n_ch, centers + k * n_ch, n_ch);
+
+                    // Ties go to the lowest center, as in the full scan, and
+                    // not to the first one of the group
+
+                    if (dist < grp_min[g] || (dist == grp_min[g] && k < grp_best[g])) {
+                        grp_sec[g] = grp_min[g];
+                        grp_min[g] = dist;
+                        grp_best[g] = k;
+                    } else if (dist < grp_sec[g]) {
+                        grp_sec[g] = dist;
+                    }
+                }
+
+                tmp_dists += grp_start[g + 1] - grp_start[g];
+
+                if (grp_min[g] < min_dist || (grp_min[g] == min_dist && grp_best[g] < min_k)) {
+                    min_dist = grp_min[g];
+                    min_k = grp_best[g];
+                }
+            }
+
+            // The lower bound of a group excludes the center the pixel is assigned to
+
+            for (g = 0; g < n_grps; g++) {
+                if (grp_best[g] >= 0) {
+                    px_lower[g] = grp_best[g] == min_k ? grp_sec[g] : grp_min[g];
+                }
+            }
+
+            if (!first && min_k != old_k) {
+                g = grp_of[old_k];
+
+                if (grp_best[g] < 0 && old_dist < px_lower[g]) {
+                    px_lower[g] = old_dist;
+                }
+            }
+
+            upper[px] = min_dist;
+        }
+
+        weight = weights ? weights[px] : 1;
+
+        if (first || old_k != min_k) {
+            SET_LABEL(labels, px, l_size, min_k);
+            tmp_changes += weight;
+        } else if (incremental) {
+            continue;
+        }
+
+        if (incremental) {
+            for (ch = 0; ch < n_ch; ch++) {
+                thr_sums[old_k * n_ch + ch] -= (double)weight * data[px * n_ch + ch];
+            }
+
+            thr_counts[old_k] -= weight;
+        }
+
+        for (ch = 0; ch < n_ch; ch++) {
+            thr_sums[min_k * n_ch + ch] += (double)weight * data[px * n_ch + ch];
+        }
+
+        thr_counts[min_k] += weight;
+    }
+
+    merge_accums(sums, counts, n_ch, n_clus);
+
+    #pragma omp atomic
+    *changes += tmp_changes;
+
+    #pragma omp atomic
+    *n_dists += tmp_dists;
+
+    #pragma omp barrier
+}
+
+void update_bounds_yinyang(void *labels, double *upper, double *lower, double *drifts, double *grp_drifts, int *grp_start, int *grp_centers, int n_px, int n_grps, int l_size)
+{
+    int px, g, i;
+    double *px_lower;
+
+    // The lower bound of a group decreases by the largest drift of its centers
+
+    #pragma omp for schedule(static)
+    for (g = 0; g < n_grps; g++) {
+        grp_drifts[g] = 0;
+
+        for (i = grp_start[g]; i < grp_start[g + 1]; i++) {
+            if (drifts[grp_centers[i]] > grp_drifts[g]) {
+                grp_drifts[g] = drifts[grp_centers[i]];
+            }
+        }
+    }
+
+    #pragma omp for schedule(static)
+    for (px = 0; px < n_px; px++) {
+        px_lower = lower + (size_t)px * n_grps;
+
+        for (g = 0; g < n_grps; g++) {
+            px_lower[g] -= grp_drifts[g];
+        }
+
+        upper[px] += drifts[GET_LABEL(labels, px, l_size)];
+    }
+}
+
+void sample_batch(int *batch, int n_px, int batch_size, unsigned int seed, int iter)
+{
+    int b;
+
+    #pragma omp for schedule(static)
+    for (b = 0; b < batch_size; b++) {
+        batch[b] = rand_index(seed, RNG_MINIBATCH + iter, b, n_px);
+    }
+}
+
+void update_centers_minibatch(byte_t *data, int *weights, double *centers, int *batch, double *totals, double *sums, int *counts, void *scratch, int batch_size, int n_ch, int n_clus, int precision, int planar)
+{
+    int b, i, n, px, ch, k;
+    int plane, weight, *thr_counts;
+    int near[DIST_BLOCK];
+    byte_t blk[DIST_BLOCK * DIST_MAX_CH];
+    double blk_dists[DIST_BLOCK], *thr_sums;
+    short *fx_centers;
+    float *f_centers;
+
+    reset_accums(sums, counts, n_ch, n_clus, 0);
+    thr_sums = THR_SUMS(sums, n_ch, n_clus);
+    thr_counts = THR_COUNTS(counts, n_clus);
+
+    fx_centers = (short *)THR_SCRATCH(scratch, ASSIGN_SCRATCH(n_clus));
+    f_centers = (float *)fx_centers;
+
+    if (precision == PREC_FIXED) {
+        quantize_centers(centers, fx_centers, n_ch, n_clus);
+    } else if (precision == PREC_FLOAT) {
+        convert_centers(centers, f_centers, n_ch, n_clus);
+    }
+
+    // Gathering a block of the batch in the layout of the kernels, which then
+    // assign it with the same arithmetic as the full passes, and accumulating
+    // the pixels by center
+
+    #pragma omp for schedule(static) nowait
+    for (b = 0; b < batch_size; b += DIST_BLOCK) {
+        n = batch_size - b < DIST_BLOCK ? batch_size - b : DIST_BLOCK;
+        plane = planar ? n : 0;
+
+        for (i = 0; i < n; i++) {
+            for (ch = 0; ch < n_ch; ch++) {
+                blk[planar ? ch * n + i : i * n_ch + ch] = data[batch[b + i] * n_ch + ch];
+            }
+        }
+
+        switch (precision) {
+            case PREC_FIXED:
+                nearest_centers_fixed(blk, fx_centers, near, blk_dists, n, n_ch, n_clus, plane);
+                break;
+            case PREC_FLOAT:
+                nearest_centers_float(blk, f_centers, near, blk_dists, n, n_ch, n_clus, plane);
+                break;
+            default:
+                nearest_centers(blk, centers, near, blk_dists, n, n_ch, n_clus, plane);
+                break;
+        }
+
+        for (i = 0; i < n; i++) {
+            px = batch[b + i];
+            weight = weights ? weights[px] : 1;
+
+            for (ch = 0; ch < n_ch; ch++) {
+                thr_sums[near[i] * n_ch + ch] += (double)weight * data[px * n_ch + ch];
+            }
+
+            thr_counts[near[i]] += weight;
+        }
+    }
+
+    merge_accums(sums, counts, n_ch, n_clus);
+
+    // Moving each center towards the batch mean with a learning rate equal to
+    // the inverse of the total weight it has absorbed so far
+
+    #pragma omp for schedule(static)
+    for (k = 0; k < n_clus; k++) {
+        if (counts[k]) {
+            totals[k] += counts[k];
+
+            for (ch = 0; ch < n_ch; ch++) {
+                centers[k * n_ch + ch] += (sums[k * n_ch + ch] - counts[k] * centers[k * n_ch + ch]) / totals[k];
+            }
+        }
+    }
+}
+
+double px_dist(byte_t *px_data, double *center, int n_ch)
+{
+    int ch;
+    double dist = 0, tmp;
+
+    for (ch = 0; ch < n_ch; ch++) {
+        tmp = (double)(px_data[ch] - center[ch]);
+        dist += tmp * tmp;
+    }
+
+    return sqrt(dist);
+}
+
+double center_dist(double *center_a, double *center_b, int n_ch)
+{
+    int ch;
+    double dist = 0, tmp;
+
+    for (ch = 0; ch < n_ch; ch++) {
+        tmp = center_a[ch] - center_b[ch];
+        dist += tmp * tmp;
+    }
+
+    return sqrt(dist);
 }
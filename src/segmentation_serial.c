@@ -1,62 +1,328 @@
 #include <stdlib.h>
+#include <string.h>
 #include <float.h>
 #include <math.h>
 
 #include "image_io.h"
+#include "random.h"
+#include "distance.h"
+#include "labels.h"
+#include "farthest.h"
 #include "segmentation.h"
 
-void init_centers(byte_t *data, double *centers, int n_px, int n_ch, int n_clus);
-void assign_pixels(byte_t *data, double *centers, int *labels, double *dists, int *changes, int n_px, int n_ch, int n_clus);
-void update_centers(byte_t *data, double *centers, int *labels, double *dists, int n_px, int n_ch, int n_clus);
-void update_data(byte_t *data, double *centers, int *labels, int n_px, int n_ch);
-void compute_sse(double *sse, double *dists, int n_px);
+#define YINYANG_GROUP_SIZE 10
+#define YINYANG_GROUP_ITERS 5
+#define HIST_MAX_BITS 20
+#define KMEANSPAR_ROUNDS 5
+#define KMEANSPAR_OVERSAMPLING 2
+#define KMEANSPAR_ITERS 10
 
-void kmeans_segm(byte_t *data, int width, int height, int n_ch, int n_clus, int *n_iters, double *sse)
+void init_centers(byte_t *data, double *centers, int n_px, int n_ch, int n_clus, unsigned int seed);
+void init_centers_kmeanspp(byte_t *data, int *weights, double *centers, int n_px, int n_ch, int n_clus, unsigned int seed);
+void init_centers_kmeanspar(byte_t *data, double *centers, int n_px, int n_ch, int n_clus, unsigned int seed);
+void assign_pixels(byte_t *data, int *weights, double *centers, void *labels, double *dists, double *far_dists, int *far_idx, int *n_far, double *sums, int *counts, int *changes, int n_px, int n_ch, int n_clus, int precision, int plane, int incremental, int l_size);
+void update_centers(byte_t *data, double *centers, double *sums, int *counts, double *dists, double *far_dists, int *far_idx, int *n_far, int n_px, int n_ch, int n_clus);
+void find_farthest(double *dists, double *far_dists, int *far_idx, int *n_far, int n_px, int max_far);
+int accumulate_pixels(byte_t *data, int *weights, int *near, void *labels, double *sums, int *counts, int n_px, int n_ch, int px_step, int ch_step, int incremental, int l_size);
+void update_data(byte_t *data, double *centers, void *labels, int *px_map, int n_px, int n_ch, int l_size);
+void to_planar(byte_t *data, byte_t *planes, int n_px, int n_ch);
+void update_data_ch(byte_t *data, double *centers, void *labels, int *px_map, int n_px, int n_ch, int l_size);
+void compute_sse(byte_t *data, int *weights, double *centers, void *labels, int *px_map, double *sse, int n_px, int n_ch, int n_clus, int l_size);
+long long sum_squares(byte_t *data, int *weights, int n_px, int n_ch);
+int check_stop(double *sums, int *counts, double *drifts, double *prev_sse, long long sq_total, int changes, int n_px, int n_ch, int n_clus, int iter, segm_params_t *params);
+int reduce_unique(byte_t *data, byte_t **pts, int **weights, int *px_map, int n_px, int n_ch);
+int reduce_hist(byte_t *data, byte_t **pts, int **weights, int *px_map, int n_px, int n_ch, int bits);
+void compute_drifts(double *old_centers, double *centers, double *drifts, int n_ch, int n_clus);
+void compute_center_dists(double *centers, double *c_dists, double *s, int n_ch, int n_clus);
+void assign_pixels_elkan(byte_t *data, int *weights, double *centers, void *labels, double *sums, int *counts, double *upper, double *lower, double *c_dists, double *s, int *changes, long long *n_dists, int n_px, int n_ch, int n_clus, int first, int incremental, int l_size);
+void update_bounds_elkan(void *labels, double *upper, double *lower, double *drifts, int n_px, int n_clus, int l_size);
+void assign_pixels_hamerly(byte_t *data, int *weights, double *centers, void *labels, double *sums, int *counts, double *upper, double *lower, double *c_dists, double *s, int *changes, long long *n_dists, int n_px, int n_ch, int n_clus, int first, int incremental, int l_size);
+void update_bounds_hamerly(void *labels, double *upper, double *lower, double *drifts, int n_px, int n_clus, int l_size);
+void group_centers(double *centers, int *grp_start, int *grp_centers, int *grp_of, int n_ch, int n_clus, int n_grps);
+void assign_pixels_yinyang(byte_t *data, int *weights, double *centers, void *labels, double *sums, int *counts, double *upper, double *lower, int *grp_start, int *grp_centers, int *grp_of, int *changes, long long *n_dists, int n_px, int n_ch, int n_clus, int n_grps, int first, int incremental, int l_size);
+void update_bounds_yinyang(void *labels, double *upper, double *lower, double *drifts, double *grp_drifts, int *grp_start, int *grp_centers, int n_px, int n_grps, int l_size);
+void sample_batch(int *batch, int n_px, int batch_size, unsigned int seed, int iter);
+void update_centers_minibatch(byte_t *data, int *weights, double *centers, int *batch, double *totals, double *sums, int *counts, int batch_size, int n_ch, int n_clus, int precision, int planar);
+double px_dist(byte_t *px_data, double *center, int n_ch);
+double center_dist(double *center_a, double *center_b, int n_ch);
+
+void kmeans_segm(byte_t *data, int width, int height, int n_ch, int n_clus, int *n_iters, double *sse, segm_params_t *params)
 {
-    int n_px;
+    int n_px, n_pts;
     int iter, max_iters;
-    int changes;
-    int *labels;
+    int changes, bounded, tracked, stop = STOP_NONE, n_grps = 0, n_far = 0;
+    long long n_dists, sq_total = 0;
+    int l_size;
+    int *counts;
+    void *labels;
+    int *weights = NULL, *px_map = NULL, *batch = NULL, *far_idx = NULL;
+    int *grp_start = NULL, *grp_centers = NULL, *grp_of = NULL;
     double *centers;
-    double *dists;
+    double *sums, *dists = NULL, *far_dists = NULL;
+    double *old_centers = NULL, *drifts = NULL, prev_sse = 0;
+    double *upper = NULL, *lower = NULL, *c_dists = NULL, *s = NULL;
+    double *grp_drifts = NULL, *totals = NULL;
+    byte_t *pts, *planes = NULL;
 
     max_iters = *n_iters;
 
     n_px = width * height;
 
-    labels = malloc(n_px * sizeof(int));
+    params->kernel = select_dist_kernel();
+
     centers = malloc(n_clus * n_ch * sizeof(double));
-    dists = malloc(n_px * sizeof(double));
 
-    init_centers(data, centers, n_px, n_ch, n_clus);
+    switch (params->init) {
+        case INIT_KMEANSPP:
+            init_centers_kmeanspp(data, NULL, centers, n_px, n_ch, n_clus, params->seed);
+            break;
+        case INIT_KMEANSPAR:
+            init_centers_kmeanspar(data, centers, n_px, n_ch, n_clus, params->seed);
+            break;
+        default:
+            init_centers(data, centers, n_px, n_ch, n_clus, params->seed);
+            break;
+    }
+
+    // Clustering either the pixels or a table of colors weighted by the
+    // number of pixels they stand for
+
+    switch (params->reduce) {
+        case REDUCE_UNIQUE:
+            px_map = malloc(n_px * sizeof(int));
+            n_pts = reduce_unique(data, &pts, &weights, px_map, n_px, n_ch);
+            break;
+        case REDUCE_HIST:
+            px_map = malloc(n_px * sizeof(int));
+            n_pts = reduce_hist(data, &pts, &weights, px_map, n_px, n_ch, params->hist_bits);
+            break;
+        default:
+            pts = data;
+            n_pts = n_px;
+            break;
+    }
+
+    params->n_points = n_pts;
+
+    // The assignment of lloyd and minibatch can read the points from a planar
+    // copy, where each channel is contiguous
+
+    if (params->layout == LAYOUT_PLANAR && (params->algo == ALGO_LLOYD || params->algo == ALGO_MINIBATCH)) {
+        planes = malloc((size_t)n_pts * n_ch * sizeof(byte_t));
+        to_planar(pts, planes, n_pts, n_ch);
+    }
+
+    // Labels use the narrowest type that fits the clusters, and start as
+    // unassigned so that the first assignment counts every pixel as changed
+
+    l_size = LABEL_SIZE(n_clus);
+    labels = malloc((size_t)n_pts * l_size);
+    memset(labels, LABEL_NONE, (size_t)n_pts * l_size);
+    sums = malloc(n_clus * n_ch * sizeof(double));
+    counts = malloc(n_clus * sizeof(int));
+
+    switch (params->algo) {
+        case ALGO_ELKAN:
+            // Elkan keeps an upper bound for each pixel and a lower bound for
+            // each pair of pixel and center, plus the table of center distances
+
+            lower = malloc((size_t)n_pts * n_clus * sizeof(double));
+            break;
+        case ALGO_HAMERLY:
+            // Hamerly keeps a single lower bound for each pixel, referred to
+            // the second closest center. With the upper bound that makes two
+            // doubles per pixel, kept in double like the bounds of the other
+            // algorithms so that they never skip a distance by rounding
+
+            lower = malloc(n_pts * sizeof(double));
+            break;
+        case ALGO_YINYANG:
+            // Yinyang keeps a lower bound for each pixel and group of centers
+
+            n_grps = n_clus / YINYANG_GROUP_SIZE > 1 ? n_clus / YINYANG_GROUP_SIZE : 1;
+            lower = malloc((size_t)n_pts * n_grps * sizeof(double));
+            grp_start = malloc((n_grps + 1) * sizeof(int));
+            grp_centers = malloc(n_clus * sizeof(int));
+            grp_of = malloc(n_clus * sizeof(int));
+            grp_drifts = malloc(n_grps * sizeof(double));
+            break;
+        case ALGO_MINIBATCH:
+            // Mini-batch keeps the total weight of the pixels each center has
+            // absorbed, which sets its learning rate
+
+            batch = malloc(params->batch_size * sizeof(int));
+            totals = calloc(n_clus, sizeof(double));
+            break;
+    }
+
+    bounded = params->algo == ALGO_ELKAN || params->algo == ALGO_HAMERLY || params->algo == ALGO_YINYANG;
+
+    // The drifts of the centers are tracked by the bounded algorithms and by
+    // the tolerance on the center shift
+
+    tracked = bounded || params->tol_shift > 0;
+
+    if (tracked) {
+        old_centers = malloc(n_clus * n_ch * sizeof(double));
+        drifts = malloc(n_clus * sizeof(double));
+    }
+
+    if (bounded) {
+        upper = malloc(n_pts * sizeof(double));
+        c_dists = malloc(n_clus * n_clus * sizeof(double));
+        s = malloc(n_clus * sizeof(double));
+    }
+
+    // The distances of all the points are kept only when the repair of empty
+    // clusters scans them, while the bounded algorithms scan their upper
+    // bounds. Otherwise the assignment keeps the farthest points, one for each
+    // cluster at most empty, in the same arrays that receive the result of the
+    // scan
+
+    if (!bounded && params->repair == REPAIR_SCAN) {
+        dists = malloc(n_pts * sizeof(double));
+    }
+
+    far_dists = malloc(n_clus * sizeof(double));
+    far_idx = malloc(n_clus * sizeof(int));
+
+    params->n_dists = 0;
+    params->n_skipped = 0;
+
+    if (params->tol_sse > 0) {
+        sq_total = sum_squares(pts, weights, n_pts, n_ch);
+    }
+
+    if (params->algo == ALGO_YINYANG) {
+        group_centers(centers, grp_start, grp_centers, grp_of, n_ch, n_clus, n_grps);
+    }
 
     for (iter = 0; iter < max_iters; iter++) {
-        assign_pixels(data, centers, labels, dists, &changes, n_px, n_ch, n_clus);
+        switch (params->algo) {
+            case ALGO_ELKAN:
+                assign_pixels_elkan(pts, weights, centers, labels, sums, counts, upper, lower, c_dists, s, &changes, &n_dists, n_pts, n_ch, n_clus, iter == 0, iter && params->update == UPDATE_INCREMENTAL, l_size);
+                break;
+            case ALGO_HAMERLY:
+                assign_pixels_hamerly(pts, weights, centers, labels, sums, counts, upper, lower, c_dists, s, &changes, &n_dists, n_pts, n_ch, n_clus, iter == 0, iter && params->update == UPDATE_INCREMENTAL, l_size);
+                break;
+            case ALGO_YINYANG:
+                assign_pixels_yinyang(pts, weights, centers, labels, sums, counts, upper, lower, grp_start, grp_centers, grp_of, &changes, &n_dists, n_pts, n_ch, n_clus, n_grps, iter == 0, iter && params->update == UPDATE_INCREMENTAL, l_size);
+                break;
+            case ALGO_MINIBATCH:
+                sample_batch(batch, n_pts, params->batch_size, params->seed, iter);
+                n_dists = (long long)params->batch_size * n_clus;
+                changes = 1;
+                break;
+            default:
+                assign_pixels(planes ? planes : pts, weights, centers, labels, dists, far_dists, far_idx, &n_far, sums, counts, &changes, n_pts, n_ch, n_clus, params->precision, planes ? n_pts : 0, iter && params->update == UPDATE_INCREMENTAL, l_size);
+                n_dists = (long long)n_pts * n_clus;
+                break;
+        }
+
+        params->n_dists += n_dists;
+        // The pixels left out of a batch are not skipped by bounds
+
+        if (params->algo != ALGO_MINIBATCH) {
+            params->n_skipped += (long long)n_pts * n_clus - n_dists;
+        }
 
         if (!changes) {
+            stop = STOP_CONVERGED;
+            break;
+        }
+
+        if (tracked) {
+            memcpy(old_centers, centers, n_clus * n_ch * sizeof(double));
+        }
+
+        if (params->algo == ALGO_MINIBATCH) {
+            update_centers_minibatch(pts, weights, centers, batch, totals, sums, counts, params->batch_size, n_ch, n_clus, params->precision, params->layout == LAYOUT_PLANAR);
+        } else {
+            update_centers(pts, centers, sums, counts, bounded ? upper : dists, far_dists, far_idx, &n_far, n_pts, n_ch, n_clus);
+        }
+
+        if (tracked) {
+            compute_drifts(old_centers, centers, drifts, n_ch, n_clus);
+        }
+
+        // The iteration counts as done, as the centers have been moved
+
+        stop = check_stop(sums, counts, drifts, &prev_sse, sq_total, changes, n_px, n_ch, n_clus, iter, params);
+
+        if (stop != STOP_NONE) {
+            iter++;
             break;
         }
 
-        update_centers(data, centers, labels, dists, n_px, n_ch, n_clus);
+        switch (params->algo) {
+            case ALGO_ELKAN:
+                update_bounds_elkan(labels, upper, lower, drifts, n_pts, n_clus, l_size);
+                break;
+            case ALGO_HAMERLY:
+                update_bounds_hamerly(labels, upper, lower, drifts, n_pts, n_clus, l_size);
+                break;
+            case ALGO_YINYANG:
+                update_bounds_yinyang(labels, upper, lower, drifts, grp_drifts, grp_start, grp_centers, n_pts, n_grps, l_size);
+                break;
+        }
+    }
+
+    if (params->algo == ALGO_MINIBATCH) {
+        // Batches only move the centers, the pixels are assigned once at the end
+
+        assign_pixels(planes ? planes : pts, weights, centers, labels, dists, far_dists, far_idx, &n_far, sums, counts, &changes, n_pts, n_ch, n_clus, params->precision, planes ? n_pts : 0, 0, l_size);
+        params->n_dists += (long long)n_pts * n_clus;
     }
 
-    update_data(data, centers, labels, n_px, n_ch);
+    // The bins of the histogram stand for pixels of different colors, so the
+    // SSE is measured on the pixels of the image to include the error inside
+    // each bin
+
+    if (params->reduce == REDUCE_HIST) {
+        compute_sse(data, NULL, centers, labels, px_map, sse, n_px, n_ch, n_clus, l_size);
+    } else {
+        compute_sse(pts, weights, centers, labels, NULL, sse, n_pts, n_ch, n_clus, l_size);
+    }
 
-    compute_sse(sse, dists, n_px);
+    update_data(data, centers, labels, px_map, n_px, n_ch, l_size);
 
     *n_iters = iter;
+    params->stop = stop;
 
+    if (pts != data) {
+        free(pts);
+        free(weights);
+        free(px_map);
+    }
+
+    free(planes);
     free(centers);
     free(labels);
     free(dists);
+    free(far_dists);
+    free(far_idx);
+    free(sums);
+    free(counts);
+    free(old_centers);
+    free(drifts);
+    free(upper);
+    free(lower);
+    free(c_dists);
+    free(s);
+    free(grp_start);
+    free(grp_centers);
+    free(grp_of);
+    free(grp_drifts);
+    free(batch);
+    free(totals);
 }
 
-void init_centers(byte_t *data, double *centers, int n_px, int n_ch, int n_clus)
+void init_centers(byte_t *data, double *centers, int n_px, int n_ch, int n_clus, unsigned int seed)
 {
     int k, ch, rnd;
 
     for (k = 0; k < n_clus; k++) {
-        rnd = rand() % n_px;
+        rnd = rand_index(seed, RNG_INIT, k, n_px);
 
         for (ch = 0; ch < n_ch; ch++) {
             centers[k * n_ch + ch] = data[rnd * n_ch + ch];
@@ -64,107 +330,350 @@ void init_centers(byte_t *data, double *centers, int n_px, int n_ch, int n_clus)
     }
 }
 
-void assign_pixels(byte_t *data, double *centers, int *labels, double *dists, int *changes, int n_px, int n_ch, int n_clus)
+void init_centers_kmeanspp(byte_t *data, int *weights, double *centers, int n_px, int n_ch, int n_clus, unsigned int seed)
 {
-    int px, ch, k;
-    int min_k, tmp_changes = 0;
-    double dist, min_dist, tmp;
+    int px, ch, k, sel, tmp, dist;
+    int *min_dists;
+    long long total, rnd;
 
-    for (px = 0; px < n_px; px++) {
-        min_dist = DBL_MAX;
+    min_dists = malloc(n_px * sizeof(int));
 
-        for (k = 0; k < n_clus; k++) {
+    sel = rand_index(seed, RNG_KMEANSPP, 0, n_px);
+
+    for (k = 0; k < n_clus; k++) {
+        for (ch = 0; ch < n_ch; ch++) {
+            centers[k * n_ch + ch] = data[sel * n_ch + ch];
+        }
+
+        if (k == n_clus - 1) {
+            break;
+        }
+
+        // Updating the squared distance of each pixel from its closest center.
+        // Centers are pixels, so the distances are exact integers
+
+        total = 0;
+
+        for (px = 0; px < n_px; px++) {
             dist = 0;
 
             for (ch = 0; ch < n_ch; ch++) {
-                tmp = (double)(data[px * n_ch + ch] - centers[k * n_ch + ch]);
+                tmp = data[px * n_ch + ch] - data[sel * n_ch + ch];
                 dist += tmp * tmp;
             }
 
-            if (dist < min_dist) {
-                min_dist = dist;
-                min_k = k;
+            if (k == 0 || dist < min_dists[px]) {
+                min_dists[px] = dist;
             }
+
+            total += (long long)(weights ? weights[px] : 1) * min_dists[px];
+        }
+
+        // Sampling the next center with probability proportional to the
+        // weighted squared distance, or uniformly if all pixels are already
+        // centers
+
+        if (!total) {
+            sel = rand_index(seed, RNG_KMEANSPP, 0, n_px);
+            continue;
         }
 
-        dists[px] = min_dist;
+        rnd = rand_u64(seed, RNG_KMEANSPP, k + 1) % total;
 
-        if (labels[px] != min_k) {
-            labels[px] = min_k;
-            tmp_changes = 1;
+        for (px = 0; rnd >= (long long)(weights ? weights[px] : 1) * min_dists[px]; px++) {
+            rnd -= (long long)(weights ? weights[px] : 1) * min_dists[px];
         }
+
+        sel = px;
     }
 
-    *changes = tmp_changes;
+    free(min_dists);
 }
 
-void update_centers(byte_t *data, double *centers, int *labels, double *dists, int n_px, int n_ch, int n_clus)
+void init_centers_kmeanspar(byte_t *data, double *centers, int n_px, int n_ch, int n_clus, unsigned int seed)
 {
-    int px, ch, k;
-    int *counts;
-    int min_k, far_px;
-    double max_dist;
+    int px, ch, c, r, iter, tmp, dist, changes;
+    int n_cands, new_cands, l_size;
+    int *min_dists, *nearest, *cand_weights, *cand_counts;
+    long long cost;
+    int n_far, *far_idx;
+    double *cand_sums, *far_dists;
+    void *cand_labels;
+    byte_t *cands;
 
-    counts = malloc(n_clus * sizeof(int));
+    min_dists = malloc(n_px * sizeof(int));
+    nearest = malloc(n_px * sizeof(int));
 
-    // Resetting centers and initializing clusters counters
+    // Starting from a single candidate chosen uniformly
 
-    for (k = 0; k < n_clus; k++) {
-        for (ch = 0; ch < n_ch; ch++) {
-            centers[k * n_ch + ch] = 0;
+    px = rand_index(seed, RNG_KMEANSPAR, 0, n_px);
+    cands = malloc(n_ch * sizeof(byte_t));
+    memcpy(cands, data + px * n_ch, n_ch);
+    n_cands = new_cands = 1;
+
+    for (r = 0; ; r++) {
+        // Updating the squared distance of each pixel from its closest
+        // candidate with the candidates added in the last round
+
+        cost = 0;
+
+        for (px = 0; px < n_px; px++) {
+            for (c = n_cands - new_cands; c < n_cands; c++) {
+                dist = 0;
+
+                for (ch = 0; ch < n_ch; ch++) {
+                    tmp = data[px * n_ch + ch] - cands[c * n_ch + ch];
+                    dist += tmp * tmp;
+                }
+
+                if (c == 0 || dist < min_dists[px]) {
+                    min_dists[px] = dist;
+                    nearest[px] = c;
+                }
+            }
+
+            cost += min_dists[px];
+        }
+
+        if (r == KMEANSPAR_ROUNDS || !cost) {
+            break;
+        }
+
+        // Oversampling each pixel independently with probability proportional
+        // to its squared distance. The draw only depends on the seed, the
+        // round and the pixel
+
+        new_cands = 0;
+
+        for (px = 0; px < n_px; px++) {
+            if (rand_unit(seed, RNG_KMEANSPAR + r + 1, px) * cost < (double)KMEANSPAR_OVERSAMPLING * n_clus * min_dists[px]) {
+                cands = realloc(cands, (n_cands + new_cands + 1) * n_ch * sizeof(byte_t));
+                memcpy(cands + (n_cands + new_cands) * n_ch, data + px * n_ch, n_ch);
+                new_cands++;
+            }
+        }
+
+        n_cands += new_cands;
+    }
+
+    // Weighting each candidate by the number of pixels closest to it
+
+    cand_weights = calloc(n_cands, sizeof(int));
+    l_size = LABEL_SIZE(n_clus);
+    cand_labels = malloc((size_t)n_cands * l_size);
+    memset(cand_labels, LABEL_NONE, (size_t)n_cands * l_size);
+    far_dists = malloc(n_clus * sizeof(double));
+    far_idx = malloc(n_clus * sizeof(int));
+    cand_sums = malloc(n_clus * n_ch * sizeof(double));
+    cand_counts = malloc(n_clus * sizeof(int));
+
+    for (px = 0; px < n_px; px++) {
+        cand_weights[nearest[px]]++;
+    }
+
+    // Reclustering the weighted candidates into the initial centers
+
+    init_centers_kmeanspp(cands, cand_weights, centers, n_cands, n_ch, n_clus, seed);
+
+    for (iter = 0; iter < KMEANSPAR_ITERS; iter++) {
+        assign_pixels(cands, cand_weights, centers, cand_labels, NULL, far_dists, far_idx, &n_far, cand_sums, cand_counts, &changes, n_cands, n_ch, n_clus, PREC_DOUBLE, 0, 0, l_size);
+
+        if (!changes) {
+            break;
+        }
+
+        update_centers(cands, centers, cand_sums, cand_counts, NULL, far_dists, far_idx, &n_far, n_cands, n_ch, n_clus);
+    }
+
+    free(min_dists);
+    free(nearest);
+    free(cands);
+    free(cand_weights);
+    free(cand_labels);
+    free(far_dists);
+    free(far_idx);
+    free(cand_sums);
+    free(cand_counts);
+}
+
+void assign_pixels(byte_t *data, int *weights, double *centers, void *labels, double *dists, double *far_dists, int *far_idx, int *n_far, double *sums, int *counts, int *changes, int n_px, int n_ch, int n_clus, int precision, int plane, int incremental, int l_size)
+{
+    int px, n, i, changed;
+    int px_step, ch_step;
+    int tmp_changes = 0, tmp_far = 0;
+    int near[DIST_BLOCK];
+    double blk_dists[DIST_BLOCK], *out_dists;
+    short *fx_centers = NULL;
+    float *f_centers = NULL;
+
+    px_step = plane ? 1 : n_ch;
+    ch_step = plane ? plane : 1;
+
+    if (!incremental) {
+        memset(sums, 0, n_clus * n_ch * sizeof(double));
+        memset(counts, 0, n_clus * sizeof(int));
+    }
+
+    if (precision == PREC_FIXED) {
+        fx_centers = malloc(n_clus * DIST_MAX_CH * sizeof(short));
+        quantize_centers(centers, fx_centers, n_ch, n_clus);
+    } else if (precision == PREC_FLOAT) {
+        f_centers = malloc(n_clus * n_ch * sizeof(float));
+        convert_centers(centers, f_centers, n_ch, n_clus);
+    }
+
+    // Finding the closest centers of a block of pixels with the vectorized
+    // kernel, then adding each pixel to the sums of its center in the same
+    // pass, so the pixels are read once per iteration. Without the array of
+    // the distances, the distances of the block only feed the farthest pixels
+
+    for (px = 0; px < n_px; px += DIST_BLOCK) {
+        n = n_px - px < DIST_BLOCK ? n_px - px : DIST_BLOCK;
+        out_dists = dists ? dists + px : blk_dists;
+
+        switch (precision) {
+            case PREC_FIXED:
+                nearest_centers_fixed(data + px * px_step, fx_centers, near, out_dists, n, n_ch, n_clus, plane);
+                break;
+            case PREC_FLOAT:
+                nearest_centers_float(data + px * px_step, f_centers, near, out_dists, n, n_ch, n_clus, plane);
+                break;
+            default:
+                nearest_centers(data + px * px_step, centers, near, out_dists, n, n_ch, n_clus, plane);
+                break;
+        }
+
+        SPECIALIZE_LABELS(l_size, SPECIALIZE_CH(n_ch, changed = accumulate_pixels(data + px * px_step, weights ? weights + px : NULL, near, (char *)labels + (size_t)px * L_SIZE, sums, counts, n, N_CH, px_step, ch_step, incremental, L_SIZE)));
+
+        tmp_changes += changed;
+
+        if (!dists) {
+            for (i = 0; i < n; i++) {
+                if (FAR_KEEPS(far_dists, tmp_far, n_clus, blk_dists[i])) {
+                    tmp_far = far_push(far_dists, far_idx, tmp_far, n_clus, blk_dists[i], px + i);
+                }
+            }
         }
+    }
 
-        counts[k] = 0;
+    if (!dists) {
+        far_sort(far_dists, far_idx, tmp_far);
+        *n_far = tmp_far;
     }
 
-    // Computing partial sums of the centers and updating clusters counters
+    *changes = tmp_changes;
+
+    free(fx_centers);
+    free(f_centers);
+}
+
+KERNEL_INLINE int accumulate_pixels(byte_t *data, int *weights, int *near, void *labels, double *sums, int *counts, int n_px, int n_ch, int px_step, int ch_step, int incremental, int l_size)
+{
+    int px, ch;
+    int min_k, old_k, weight, changed = 0;
+
+    // Storing the new labels of a block of pixels and adding the pixels to
+    // the sums of their centers
 
     for (px = 0; px < n_px; px++) {
-        min_k = labels[px];
+        min_k = near[px];
+        old_k = GET_LABEL(labels, px, l_size);
+        weight = weights ? weights[px] : 1;
+
+        if (old_k != min_k) {
+            SET_LABEL(labels, px, l_size, min_k);
+            changed += weight;
+        } else if (incremental) {
+            continue;
+        }
+
+        // In incremental mode the sums still hold the previous assignment, so
+        // only the pixels changing center are moved from the old one to the new
+
+        if (incremental) {
+            for (ch = 0; ch < n_ch; ch++) {
+                sums[old_k * n_ch + ch] -= (double)weight * data[px * px_step + ch * ch_step];
+            }
+
+            counts[old_k] -= weight;
+        }
 
         for (ch = 0; ch < n_ch; ch++) {
-            centers[min_k * n_ch + ch] += data[px * n_ch + ch];
+            sums[min_k * n_ch + ch] += (double)weight * data[px * px_step + ch * ch_step];
+        }
+
+        counts[min_k] += weight;
+    }
+
+    return changed;
+}
+
+void update_centers(byte_t *data, double *centers, double *sums, int *counts, double *dists, double *far_dists, int *far_idx, int *n_far, int n_px, int n_ch, int n_clus)
+{
+    int ch, k;
+    int far_px, n_empty = 0, n_used = 0;
+
+    // When the distances of all the pixels are kept, the farthest pixels
+    // needed by the empty clusters are found together in a single pass
+
+    if (dists) {
+        for (k = 0; k < n_clus; k++) {
+            if (!counts[k]) {
+                n_empty++;
+            }
         }
 
-        counts[min_k]++;
+        if (n_empty) {
+            find_farthest(dists, far_dists, far_idx, n_far, n_px, n_empty);
+        }
     }
 
-    // Dividing to obtain the centers mean
+    // Dividing the sums accumulated by the assignment to obtain the centers mean
 
     for (k = 0; k < n_clus; k++) {
         if (counts[k]) {
             for (ch = 0; ch < n_ch; ch++) {
-                centers[k * n_ch + ch] /= counts[k];
+                centers[k * n_ch + ch] = sums[k * n_ch + ch] / counts[k];
             }
         } else {
-            // If the cluster is empty we find the farthest pixel from its cluster center
+            // If the cluster is empty we take the farthest pixel from its
+            // cluster center not taken yet by another empty cluster
 
-            max_dist = 0;
-
-            for (px = 0; px < n_px; px++) {
-                if (dists[px] > max_dist) {
-                    max_dist = dists[px];
-                    far_px = px;
-                }
-            }
+            far_px = n_used < *n_far ? far_idx[n_used++] : 0;
 
             for (ch = 0; ch < n_ch; ch++) {
                 centers[k * n_ch + ch] = data[far_px * n_ch + ch];
             }
+        }
+    }
+}
+
+void find_farthest(double *dists, double *far_dists, int *far_idx, int *n_far, int n_px, int max_far)
+{
+    int px;
+
+    *n_far = 0;
 
-            dists[far_px] = 0;
+    for (px = 0; px < n_px; px++) {
+        if (FAR_KEEPS(far_dists, *n_far, max_far, dists[px])) {
+            *n_far = far_push(far_dists, far_idx, *n_far, max_far, dists[px], px);
         }
     }
 
-    free(counts);
+    far_sort(far_dists, far_idx, *n_far);
+}
+
+void update_data(byte_t *data, double *centers, void *labels, int *px_map, int n_px, int n_ch, int l_size)
+{
+    SPECIALIZE_LABELS(l_size, SPECIALIZE_CH(n_ch, update_data_ch(data, centers, labels, px_map, n_px, N_CH, L_SIZE)));
 }
 
-void update_data(byte_t *data, double *centers, int *labels, int n_px, int n_ch)
+KERNEL_INLINE void update_data_ch(byte_t *data, double *centers, void *labels, int *px_map, int n_px, int n_ch, int l_size)
 {
     int px, ch, min_k;
 
     for (px = 0; px < n_px; px++) {
-        min_k = labels[px];
+        min_k = px_map ? GET_LABEL(labels, px_map[px], l_size) : GET_LABEL(labels, px, l_size);
 
         for (ch = 0; ch < n_ch; ch++) {
             data[px * n_ch + ch] = (byte_t)round(centers[min_k * n_ch + ch]);
@@ -172,14 +681,929 @@ void update_data(byte_t *data, double *centers, int *labels, int n_px, int n_ch)
     }
 }
 
-void compute_sse(double *sse, double *dists, int n_px)
+void to_planar(byte_t *data, byte_t *planes, int n_px, int n_ch)
 {
-    int px;
-    double res = 0;
+    int px, ch;
+
+    // Splitting the interleaved channels in one contiguous plane each
+
+    for (px = 0; px < n_px; px++) {
+        for (ch = 0; ch < n_ch; ch++) {
+            planes[(size_t)ch * n_px + px] = data[px * n_ch + ch];
+        }
+    }
+}
+
+void compute_sse(byte_t *data, int *weights, double *centers, void *labels, int *px_map, double *sse, int n_px, int n_ch, int n_clus, int l_size)
+{
+    int px, ch, k;
+    int min_k, weight;
+    long long *sums, *sq_sums, *counts;
+    double res = 0, center;
+
+    sums = calloc(n_clus * n_ch, sizeof(long long));
+    sq_sums = calloc(n_clus, sizeof(long long));
+    counts = calloc(n_clus, sizeof(long long));
+
+    // Accumulating the integer moments of each cluster, which are exact and
+    // then do not depend on the order of the sum
 
     for (px = 0; px < n_px; px++) {
-        res += dists[px];
+        min_k = px_map ? GET_LABEL(labels, px_map[px], l_size) : GET_LABEL(labels, px, l_size);
+        weight = weights ? weights[px] : 1;
+
+        for (ch = 0; ch < n_ch; ch++) {
+            sums[min_k * n_ch + ch] += (long long)weight * data[px * n_ch + ch];
+            sq_sums[min_k] += (long long)weight * data[px * n_ch + ch] * data[px * n_ch + ch];
+        }
+
+        counts[min_k] += weight;
+    }
+
+    // Expanding the squared distances from the centers in terms of the moments
+
+    for (k = 0; k < n_clus; k++) {
+        res += sq_sums[k];
+
+        for (ch = 0; ch < n_ch; ch++) {
+            center = centers[k * n_ch + ch];
+            res += center * (counts[k] * center - 2 * sums[k * n_ch + ch]);
+        }
     }
 
     *sse = res;
+
+    free(sums);
+    free(sq_sums);
+    free(counts);
+}
+
+long long sum_squares(byte_t *data, int *weights, int n_px, int n_ch)
+{
+    int px, ch, weight;
+    long long total = 0;
+
+    // Sum of the squared channels of all the pixels, which does not depend
+    // on the clusters and is computed once
+
+    for (px = 0; px < n_px; px++) {
+        weight = weights ? weights[px] : 1;
+
+        for (ch = 0; ch < n_ch; ch++) {
+            total += (long long)weight * data[px * n_ch + ch] * data[px * n_ch + ch];
+        }
+    }
+
+    return total;
+}
+
+int check_stop(double *sums, int *counts, double *drifts, double *prev_sse, long long sq_total, int changes, int n_px, int n_ch, int n_clus, int iter, segm_params_t *params)
+{
+    int k, ch;
+    double iter_sse, max_drift = 0;
+
+    // The fraction of changed pixels and the SSE are only known when all the
+    // pixels are assigned at each iteration, which mini-batch does not do
+
+    if (params->algo != ALGO_MINIBATCH) {
+        if (changes <= params->tol_changes * n_px) {
+            return STOP_CHANGES;
+        }
+
+        if (params->tol_sse > 0) {
+            // The SSE of the clusters around their means follows from the sums
+            // accumulated for the update and the squares of the pixels
+
+            iter_sse = sq_total;
+
+            for (k = 0; k < n_clus; k++) {
+                for (ch = 0; ch < n_ch && counts[k]; ch++) {
+                    iter_sse -= sums[k * n_ch + ch] * sums[k * n_ch + ch] / counts[k];
+                }
+            }
+
+            if (iter && *prev_sse - iter_sse <= params->tol_sse * *prev_sse) {
+                return STOP_SSE;
+            }
+
+            *prev_sse = iter_sse;
+        }
+    }
+
+    if (params->tol_shift > 0) {
+        for (k = 0; k < n_clus; k++) {
+            if (drifts[k] > max_drift) {
+                max_drift = drifts[k];
+            }
+        }
+
+        if (max_drift <= params->tol_shift) {
+            return STOP_SHIFT;
+        }
+    }
+
+    return STOP_NONE;
+}
+
+int reduce_unique(byte_t *data, byte_t **pts, int **weights, int *px_map, int n_px, int n_ch)
+{
+    int px, ch, i, j, pass, n_pts;
+    int counts[256], *order, *tmp_order, *swap_order;
+    unsigned int *keys, *tmp_keys, *swap_keys;
+
+    keys = malloc(n_px * sizeof(unsigned int));
+    tmp_keys = malloc(n_px * sizeof(unsigned int));
+    order = malloc(n_px * sizeof(int));
+    tmp_order = malloc(n_px * sizeof(int));
+
+    // Packing the channels of each pixel in a single key
+
+    for (px = 0; px < n_px; px++) {
+        keys[px] = 0;
+
+        for (ch = 0; ch < n_ch; ch++) {
+            keys[px] = keys[px] << 8 | data[px * n_ch + ch];
+        }
+
+        order[px] = px;
+    }
+
+    // Sorting the keys one byte at a time with a stable counting sort
+
+    for (pass = 0; pass < n_ch; pass++) {
+        memset(counts, 0, sizeof(counts));
+
+        for (i = 0; i < n_px; i++) {
+            counts[keys[i] >> (8 * pass) & 0xFF]++;
+        }
+
+        for (j = 0, i = 0; j < 256; j++) {
+            px = counts[j];
+            counts[j] = i;
+            i += px;
+        }
+
+        for (i = 0; i < n_px; i++) {
+            j = counts[keys[i] >> (8 * pass) & 0xFF]++;
+            tmp_keys[j] = keys[i];
+            tmp_order[j] = order[i];
+        }
+
+        swap_keys = keys, keys = tmp_keys, tmp_keys = swap_keys;
+        swap_order = order, order = tmp_order, tmp_order = swap_order;
+    }
+
+    // Collecting each run of equal keys as a weighted color
+
+    n_pts = 0;
+
+    for (i = 0; i < n_px; i++) {
+        if (i == 0 || keys[i] != keys[i - 1]) {
+            n_pts++;
+        }
+    }
+
+    *pts = malloc(n_pts * n_ch * sizeof(byte_t));
+    *weights = calloc(n_pts, sizeof(int));
+
+    for (i = 0, j = -1; i < n_px; i++) {
+        if (i == 0 || keys[i] != keys[i - 1]) {
+            j++;
+            memcpy(*pts + j * n_ch, data + order[i] * n_ch, n_ch);
+        }
+
+        px_map[order[i]] = j;
+        (*weights)[j]++;
+    }
+
+    free(keys);
+    free(tmp_keys);
+    free(order);
+    free(tmp_order);
+
+    return n_pts;
+}
+
+int reduce_hist(byte_t *data, byte_t **pts, int **weights, int *px_map, int n_px, int n_ch, int bits)
+{
+    int px, ch, bin, n_bins, n_pts;
+    int *counts, *bin_map;
+    long long *sums;
+
+    // Limiting the size of the histogram for images with many channels
+
+    if (bits * n_ch > HIST_MAX_BITS) {
+        bits = HIST_MAX_BITS / n_ch;
+    }
+
+    n_bins = 1 << (bits * n_ch);
+
+    counts = calloc(n_bins, sizeof(int));
+    sums = calloc(n_bins * n_ch, sizeof(long long));
+    bin_map = malloc(n_bins * sizeof(int));
+
+    // Accumulating the pixels falling in each bin, identified by the most
+    // significant bits of the channels
+
+    for (px = 0; px < n_px; px++) {
+        bin = 0;
+
+        for (ch = 0; ch < n_ch; ch++) {
+            bin = bin << bits | data[px * n_ch + ch] >> (8 - bits);
+        }
+
+        for (ch = 0; ch < n_ch; ch++) {
+            sums[bin * n_ch + ch] += data[px * n_ch + ch];
+        }
+
+        counts[bin]++;
+    }
+
+    // Each non-empty bin becomes a color placed in the centroid of its pixels
+
+    n_pts = 0;
+
+    for (bin = 0; bin < n_bins; bin++) {
+        bin_map[bin] = counts[bin] ? n_pts++ : -1;
+    }
+
+    *pts = malloc(n_pts * n_ch * sizeof(byte_t));
+    *weights = malloc(n_pts * sizeof(int));
+
+    for (bin = 0; bin < n_bins; bin++) {
+        if (counts[bin]) {
+            for (ch = 0; ch < n_ch; ch++) {
+                (*pts)[bin_map[bin] * n_ch + ch] = (sums[bin * n_ch + ch] + counts[bin] / 2) / counts[bin];
+            }
+
+            (*weights)[bin_map[bin]] = counts[bin];
+        }
+    }
+
+    // Mapping the pixels to the colors of their bins
+
+    for (px = 0; px < n_px; px++) {
+        bin = 0;
+
+        for (ch = 0; ch < n_ch; ch++) {
+            bin = bin << bits | data[px * n_ch + ch] >> (8 - bits);
+        }
+
+        px_map[px] = bin_map[bin];
+    }
+
+    free(counts);
+    free(sums);
+    free(bin_map);
+
+    return n_pts;
+}
+
+void compute_drifts(double *old_centers, double *centers, double *drifts, int n_ch, int n_clus)
+{
+    int k;
+
+    for (k = 0; k < n_clus; k++) {
+        drifts[k] = center_dist(old_centers + k * n_ch, centers + k * n_ch, n_ch);
+    }
+}
+
+void compute_center_dists(double *centers, double *c_dists, double *s, int n_ch, int n_clus)
+{
+    int k, j;
+
+    // Computing the distances between centers and half the distance of each
+    // center from its nearest one
+
+    for (k = 0; k < n_clus; k++) {
+        s[k] = DBL_MAX;
+
+        for (j = 0; j < n_clus; j++) {
+            c_dists[k * n_clus + j] = center_dist(centers + k * n_ch, centers + j * n_ch, n_ch);
+
+            if (j != k && c_dists[k * n_clus + j] < s[k]) {
+                s[k] = c_dists[k * n_clus + j];
+            }
+        }
+
+        s[k] *= 0.5;
+    }
+}
+
+void assign_pixels_elkan(byte_t *data, int *weights, double *centers, void *labels, double *sums, int *counts, double *upper, double *lower, double *c_dists, double *s, int *changes, long long *n_dists, int n_px, int n_ch, int n_clus, int first, int incremental, int l_size)
+{
+    int px, ch, k;
+    int min_k, old_k, stale, weight, tmp_changes = 0;
+    long long tmp_dists = 0;
+    double dist, min_dist, *px_lower;
+
+    if (!incremental) {
+        memset(sums, 0, n_clus * n_ch * sizeof(double));
+        memset(counts, 0, n_clus * sizeof(int));
+    }
+
+    if (first) {
+        // Without valid bounds every distance has to be computed once
+
+        for (px = 0; px < n_px; px++) {
+            px_lower = lower + (size_t)px * n_clus;
+            min_dist = DBL_MAX;
+            min_k = 0;
+
+            for (k = 0; k < n_clus; k++) {
+                dist = px_dist(data + px * n_ch, centers + k * n_ch, n_ch);
+                px_lower[k] = dist;
+                tmp_dists++;
+
+                if (dist < min_dist) {
+                    min_dist = dist;
+                    min_k = k;
+                }
+            }
+
+            upper[px] = min_dist;
+            SET_LABEL(labels, px, l_size, min_k);
+
+            weight = weights ? weights[px] : 1;
+            tmp_changes += weight;
+
+            for (ch = 0; ch < n_ch; ch++) {
+                sums[min_k * n_ch + ch] += (double)weight * data[px * n_ch + ch];
+            }
+
+            counts[min_k] += weight;
+        }
+
+        *changes = tmp_changes;
+        *n_dists = (long long)n_px * n_clus;
+        return;
+    }
+
+    compute_center_dists(centers, c_dists, s, n_ch, n_clus);
+
+    for (px = 0; px < n_px; px++) {
+        px_lower = lower + (size_t)px * n_clus;
+        min_k = GET_LABEL(labels, px, l_size);
+        min_dist = upper[px];
+
+        // If the pixel is closer to its center than half the distance of the
+        // center from any other one, the assignment cannot change
+
+        if (min_dist > s[min_k]) {
+            stale = 1;
+
+            for (k = 0; k < n_clus; k++) {
+                if (k == min_k || min_dist <= px_lower[k] || min_dist <= 0.5 * c_dists[min_k * n_clus + k]) {
+                    continue;
+                }
+
+                // Tightening the upper bound before computing other distances
+
+                if (stale) {
+                    min_dist = px_dist(data + px * n_ch, centers + min_k * n_ch, n_ch);
+                    px_lower[min_k] = min_dist;
+                    stale = 0;
+                    tmp_dists++;
+
+                    if (min_dist <= px_lower[k] || min_dist <= 0.5 * c_dists[min_k * n_clus + k]) {
+                        continue;
+                    }
+                }
+
+                dist = px_dist(data + px * n_ch, centers + k * n_ch, n_ch);
+                px_lower[k] = dist;
+                tmp_dists++;
+
+                if (dist < min_dist) {
+                    min_dist = dist;
+                    min_k = k;
+                }
+            }
+
+            upper[px] = min_dist;
+        }
+
+        old_k = GET_LABEL(labels, px, l_size);
+        weight = weights ? weights[px] : 1;
+
+        if (old_k != min_k) {
+            SET_LABEL(labels, px, l_size, min_k);
+            tmp_changes += weight;
+        } else if (incremental) {
+            continue;
+        }
+
+        if (incremental) {
+            for (ch = 0; ch < n_ch; ch++) {
+                sums[old_k * n_ch + ch] -= (double)weight * data[px * n_ch + ch];
+            }
+
+            counts[old_k] -= weight;
+        }
+
+        for (ch = 0; ch < n_ch; ch++) {
+            sums[min_k * n_ch + ch] += (double)weight * data[px * n_ch + ch];
+        }
+
+        counts[min_k] += weight;
+    }
+
+    *changes = tmp_changes;
+    *n_dists = tmp_dists;
+}
+
+void update_bounds_elkan(void *labels, double *upper, double *lower, double *drifts, int n_px, int n_clus, int l_size)
+{
+    int px, k;
+    double *px_lower;
+
+    for (px = 0; px < n_px; px++) {
+        px_lower = lower + (size_t)px * n_clus;
+
+        for (k = 0; k < n_clus; k++) {
+            px_lower[k] = px_lower[k] > drifts[k] ? px_lower[k] - drifts[k] : 0;
+        }
+
+        upper[px] += drifts[GET_LABEL(labels, px, l_size)];
+    }
+}
+
+void assign_pixels_hamerly(byte_t *data, int *weights, double *centers, void *labels, double *sums, int *counts, double *upper, double *lower, double *c_dists, double *s, int *changes, long long *n_dists, int n_px, int n_ch, int n_clus, int first, int incremental, int l_size)
+{
+    int px, ch, k;
+    int min_k, old_k, scan, weight, tmp_changes = 0;
+    long long tmp_dists = 0;
+    double dist, min_dist, sec_dist, bound;
+
+    if (!incremental) {
+        memset(sums, 0, n_clus * n_ch * sizeof(double));
+        memset(counts, 0, n_clus * sizeof(int));
+    }
+
+    if (!first) {
+        compute_center_dists(centers, c_dists, s, n_ch, n_clus);
+    }
+
+    for (px = 0; px < n_px; px++) {
+        min_k = GET_LABEL(labels, px, l_size);
+        scan = 1;
+
+        if (!first) {
+            // The assignment cannot change if the upper bound does not exceed
+            // both the lower bound and half the distance to the nearest center
+
+            bound = lower[px] > s[min_k] ? lower[px] : s[min_k];
+
+            if (upper[px] > bound) {
+                upper[px] = px_dist(data + px * n_ch, centers + min_k * n_ch, n_ch);
+                tmp_dists++;
+            }
+
+            scan = upper[px] > bound;
+        }
+
+        if (scan) {
+            // Finding the two closest centers to refresh both bounds
+
+            min_dist = sec_dist = DBL_MAX;
+
+            for (k = 0; k < n_clus; k++) {
+                dist = px_dist(data + px * n_ch, centers + k * n_ch, n_ch);
+
+                if (dist < min_dist) {
+                    sec_dist = min_dist;
+                    min_dist = dist;
+                    min_k = k;
+                } else if (dist < sec_dist) {
+                    sec_dist = dist;
+                }
+            }
+
+            tmp_dists += n_clus;
+
+            upper[px] = min_dist;
+            lower[px] = sec_dist;
+        }
+
+        old_k = GET_LABEL(labels, px, l_size);
+        weight = weights ? weights[px] : 1;
+
+        if (first || old_k != min_k) {
+            SET_LABEL(labels, px, l_size, min_k);
+            tmp_changes += weight;
+        } else if (incremental) {
+            continue;
+        }
+
+        if (incremental) {
+            for (ch = 0; ch < n_ch; ch++) {
+                sums[old_k * n_ch + ch] -= (double)weight * data[px * n_ch + ch];
+            }
+
+            counts[old_k] -= weight;
+        }
+
+        for (ch = 0; ch < n_ch; ch++) {
+            sums[min_k * n_ch + ch] += (double)weight * data[px * n_ch + ch];
+        }
+
+        counts[min_k] += weight;
+    }
+
+    *changes = tmp_changes;
+    *n_dists = tmp_dists;
+}
+
+void update_bounds_hamerly(void *labels, double *upper, double *lower, double *drifts, int n_px, int n_clus, int l_size)
+{
+    int px, k, max_k;
+    double max_drift, sec_drift;
+
+    // The lower bound of a pixel decreases by the largest drift among the
+    // centers it is not assigned to
+
+    max_k = 0;
+    max_drift = sec_drift = 0;
+
+    for (k = 0; k < n_clus; k++) {
+        if (drifts[k] > max_drift) {
+            sec_drift = max_drift;
+            max_drift = drifts[k];
+            max_k = k;
+        } else if (drifts[k] > sec_drift) {
+            sec_drift = drifts[k];
+        }
+    }
+
+    for (px = 0; px < n_px; px++) {
+        upper[px] += drifts[GET_LABEL(labels, px, l_size)];
+        lower[px] -= GET_LABEL(labels, px, l_size) == max_k ? sec_drift : max_drift;
+    }
+}
+
+void group_centers(double *centers, int *grp_start, int *grp_centers, int *grp_of, int n_ch, int n_clus, int n_grps)
+{
+    int g, k, ch, iter, min_g, max_g;
+    int *counts;
+    double dist, min_dist, *grp_means;
+
+    counts = malloc(n_grps * sizeof(int));
+    grp_means = malloc(n_grps * n_ch * sizeof(double));
+
+    // Clustering the initial centers in groups with a few k-means iterations
+
+    for (g = 0; g < n_grps; g++) {
+        for (ch = 0; ch < n_ch; ch++) {
+            grp_means[g * n_ch + ch] = centers[(g * n_clus / n_grps) * n_ch + ch];
+        }
+    }
+
+    for (iter = 0; iter < YINYANG_GROUP_ITERS; iter++) {
+        for (k = 0; k < n_clus; k++) {
+            min_dist = DBL_MAX;
+            min_g = 0;
+
+            for (g = 0; g < n_grps; g++) {
+                dist = center_dist(centers + k * n_ch, grp_means + g * n_ch, n_ch);
+
+                if (dist < min_dist) {
+                    min_dist = dist;
+                    min_g = g;
+                }
+            }
+
+            grp_of[k] = min_g;
+        }
+
+        for (g = 0; g < n_grps; g++) {
+            for (ch = 0; ch < n_ch; ch++) {
+                grp_means[g * n_ch + ch] = 0;
+            }
+
+            counts[g] = 0;
+        }
+
+        for (k = 0; k < n_clus; k++) {
+            for (ch = 0; ch < n_ch; ch++) {
+                grp_means[grp_of[k] * n_ch + ch] += centers[k * n_ch + ch];
+            }
+
+            counts[grp_of[k]]++;
+        }
+
+        for (g = 0; g < n_grps; g++) {
+            for (ch = 0; ch < n_ch; ch++) {
+                grp_means[g * n_ch + ch] /= counts[g] ? counts[g] : 1;
+            }
+        }
+    }
+
+    // Moving a center from the largest group into each empty one
+
+    for (g = 0; g < n_grps; g++) {
+        if (!counts[g]) {
+            max_g = 0;
+
+            for (min_g = 1; min_g < n_grps; min_g++) {
+                if (counts[min_g] > counts[max_g]) {
+                    max_g = min_g;
+                }
+            }
+
+            for (k = 0; grp_of[k] != max_g; k++);
+
+            grp_of[k] = g;
+            counts[max_g]--;
+            counts[g]++;
+        }
+    }
+
+    // Listing the centers of each group contiguously
+
+    grp_start[0] = 0;
+
+    for (g = 0; g < n_grps; g++) {
+        grp_start[g + 1] = grp_start[g] + counts[g];
+        counts[g] = grp_start[g];
+    }
+
+    for (k = 0; k < n_clus; k++) {
+        grp_centers[counts[grp_of[k]]++] = k;
+    }
+
+    free(counts);
+    free(grp_means);
+}
+
+void assign_pixels_yinyang(byte_t *data, int *weights, double *centers, void *labels, double *sums, int *counts, double *upper, double *lower, int *grp_start, int *grp_centers, int *grp_of, int *changes, long long *n_dists, int n_px, int n_ch, int n_clus, int n_grps, int first, int incremental, int l_size)
+{
+    int px, ch, g, i, k;
+    int min_k, old_k, scan, weight, tmp_changes = 0;
+    int *grp_best;
+    long long tmp_dists = 0;
+    double dist, min_dist, old_dist, glob_lower, *px_lower;
+    double *grp_min, *grp_sec;
+
+    if (!incremental) {
+        memset(sums, 0, n_clus * n_ch * sizeof(double));
+        memset(counts, 0, n_clus * sizeof(int));
+    }
+
+    // The closest centers found in each scanned group of centers
+
+    grp_min = malloc(n_grps * sizeof(double));
+    grp_sec = malloc(n_grps * sizeof(double));
+    grp_best = malloc(n_grps * sizeof(int));
+
+    for (px = 0; px < n_px; px++) {
+        px_lower = lower + (size_t)px * n_grps;
+        old_k = min_k = GET_LABEL(labels, px, l_size);
+        old_dist = min_dist = DBL_MAX;
+        scan = 1;
+
+        if (!first) {
+            // The assignment cannot change if the upper bound does not exceed the
+            // lower bounds of all the groups
+
+            glob_lower = DBL_MAX;
+
+            for (g = 0; g < n_grps; g++) {
+                if (px_lower[g] < glob_lower) {
+                    glob_lower = px_lower[g];
+                }
+            }
+
+            if (upper[px] > glob_lower) {
+                upper[px] = px_dist(data + px * n_ch, centers + min_k * n_ch, n_ch);
+                tmp_dists++;
+            }
+
+            scan = upper[px] > glob_lower;
+            old_dist = min_dist = upper[px];
+        }
+
+        if (scan) {
+            // Scanning only the groups whose lower bound is below the best distance
+
+            for (g = 0; g < n_grps; g++) {
+                grp_best[g] = -1;
+
+                if (!first && px_lower[g] >= min_dist) {
+                    continue;
+                }
+
+                grp_min[g] = grp_sec[g] = DBL_MAX;
+
+                for (i = grp_start[g]; i < grp_start[g + 1]; i++) {
+                    k = grp_centers[i];
+                    dist = px_dist(data + px * n_ch, centers + k * n_ch, n_ch);
+
+                    // Ties go to the lowest center, as in the full scan, and
+                    // not to the first one of the group
+
+                    if (dist < grp_min[g] || (dist == grp_min[g] && k < grp_best[g])) {
+                        grp_sec[g] = grp_min[g];
+                        grp_min[g] = dist;
+                        grp_best[g] = k;
+                    } else if (dist < grp_sec[g]) {
+                        grp_sec[g] = dist;
+                    }
+                }
+
+                tmp_dists += grp_start[g + 1] - grp_start[g];
+
+                if (grp_min[g] < min_dist || (grp_min[g] == min_dist && grp_best[g] < min_k)) {
+                    min_dist = grp_min[g];
+                    min_k = grp_best[g];
+                }
+            }
+
+            // The lower bound of a group excludes the center the pixel is assigned to
+
+            for (g = 0; g < n_grps; g++) {
+                if (grp_best[g] >= 0) {
+                    px_lower[g] = grp_best[g] == min_k ? grp_sec[g] : grp_min[g];
+                }
+            }
+
+            if (!first && min_k != old_k) {
+                g = grp_of[old_k];
+
+                if (grp_best[g] < 0 && old_dist < px_lower[g]) {
+                    px_lower[g] = old_dist;
+                }
+            }
+
+            upper[px] = min_dist;
+        }
+
+        weight = weights ? weights[px] : 1;
+
+        if (first || old_k != min_k) {
+            SET_LABEL(labels, px, l_size, min_k);
+            tmp_changes += weight;
+        } else if (incremental) {
+            continue;
+        }
+
+        if (incremental) {
+            for (ch = 0; ch < n_ch; ch++) {
+                sums[old_k * n_ch + ch] -= (double)weight * data[px * n_ch + ch];
+            }
+
+            counts[old_k] -= weight;
+        }
+
+        for (ch = 0; ch < n_ch; ch++) {
+            sums[min_k * n_ch + ch] += (double)weight * data[px * n_ch + ch];
+        }
+
+        counts[min_k] += weight;
+    }
+
+    free(grp_min);
+    free(grp_sec);
+    free(grp_best);
+
+    *changes = tmp_changes;
+    *n_dists = tmp_dists;
+}
+
+void update_bounds_yinyang(void *labels, double *upper, double *lower, double *drifts, double *grp_drifts, int *grp_start, int *grp_centers, int n_px, int n_grps, int l_size)
+{
+    int px, g, i;
+    double *px_lower;
+
+    // The lower bound of a group decreases by the largest drift of its centers
+
+    for (g = 0; g < n_grps; g++) {
+        grp_drifts[g] = 0;
+
+        for (i = grp_start[g]; i < grp_start[g + 1]; i++) {
+            if (drifts[grp_centers[i]] > grp_drifts[g]) {
+                grp_drifts[g] = drifts[grp_centers[i]];
+            }
+        }
+    }
+
+    for (px = 0; px < n_px; px++) {
+        px_lower = lower + (size_t)px * n_grps;
+
+        for (g = 0; g < n_grps; g++) {
+            px_lower[g] -= grp_drifts[g];
+        }
+
+        upper[px] += drifts[GET_LABEL(labels, px, l_size)];
+    }
+}
+
+void sample_batch(int *batch, int n_px, int batch_size, unsigned int seed, int iter)
+{
+    int b;
+
+    for (b = 0; b < batch_size; b++) {
+        batch[b] = rand_index(seed, RNG_MINIBATCH + iter, b, n_px);
+    }
+}
+
+void update_centers_minibatch(byte_t *data, int *weights, double *centers, int *batch, double *totals, double *sums, int *counts, int batch_size, int n_ch, int n_clus, int precision, int planar)
+{
+    int b, i, n, px, ch, k;
+    int plane, weight;
+    int near[DIST_BLOCK];
+    byte_t blk[DIST_BLOCK * DIST_MAX_CH];
+    double blk_dists[DIST_BLOCK];
+    short *fx_centers = NULL;
+    float *f_centers = NULL;
+
+    memset(sums, 0, n_clus * n_ch * sizeof(double));
+    memset(counts, 0, n_clus * sizeof(int));
+
+    if (precision == PREC_FIXED) {
+        fx_centers = malloc(n_clus * DIST_MAX_CH * sizeof(short));
+        quantize_centers(centers, fx_centers, n_ch, n_clus);
+    } else if (precision == PREC_FLOAT) {
+        f_centers = malloc(n_clus * n_ch * sizeof(float));
+        convert_centers(centers, f_centers, n_ch, n_clus);
+    }
+
+    // Gathering a block of the batch in the layout of the kernels, which then
+    // assign it with the same arithmetic as the full passes, and accumulating
+    // the pixels by center
+
+    for (b = 0; b < batch_size; b += DIST_BLOCK) {
+        n = batch_size - b < DIST_BLOCK ? batch_size - b : DIST_BLOCK;
+        plane = planar ? n : 0;
+
+        for (i = 0; i < n; i++) {
+            for (ch = 0; ch < n_ch; ch++) {
+                blk[planar ? ch * n + i : i * n_ch + ch] = data[batch[b + i] * n_ch + ch];
+            }
+        }
+
+        switch (precision) {
+            case PREC_FIXED:
+                nearest_centers_fixed(blk, fx_centers, near, blk_dists, n, n_ch, n_clus, plane);
+                break;
+            case PREC_FLOAT:
+                nearest_centers_float(blk, f_centers, near, blk_dists, n, n_ch, n_clus, plane);
+                break;
+            default:
+                nearest_centers(blk, centers, near, blk_dists, n, n_ch, n_clus, plane);
+                break;
+        }
+
+        for (i = 0; i < n; i++) {
+            px = batch[b + i];
+            weight = weights ? weights[px] : 1;
+
+            for (ch = 0; ch < n_ch; ch++) {
+                sums[near[i] * n_ch + ch] += (double)weight * data[px * n_ch + ch];
+            }
+
+            counts[near[i]] += weight;
+        }
+    }
+
+    free(fx_centers);
+    free(f_centers);
+
+    // Moving each center towards the batch mean with a learning rate equal to
+    // the inverse of the total weight it has absorbed so far
+
+    for (k = 0; k < n_clus; k++) {
+        if (counts[k]) {
+            totals[k] += counts[k];
+
+            for (ch = 0; ch < n_ch; ch++) {
+                centers[k * n_ch + ch] += (sums[k * n_ch + ch] - counts[k] * centers[k * n_ch + ch]) / totals[k];
+            }
+        }
+    }
+}
+
+double px_dist(byte_t *px_data, double *center, int n_ch)
+{
+    int ch;
+    double dist = 0, tmp;
+
+    for (ch = 0; ch < n_ch; ch++) {
+        tmp = (double)(px_data[ch] - center[ch]);
+        dist += tmp * tmp;
+    }
+
+    return sqrt(dist);
+}
+
+double center_dist(double *center_a, double *center_b, int n_ch)
+{
+    int ch;
+    double dist = 0, tmp;
+
+    for (ch = 0; ch < n_ch; ch++) {
+        tmp = center_a[ch] - center_b[ch];
+        dist += tmp * tmp;
+    }
+
+    return sqrt(dist);
 }
@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tuning.h"
+
+#define TUNE_HOST_LEN 256
+#define TUNE_PATH_LEN 4096
+
+int tune_cache_path(char *path);
+
+int tune_size_class(long long work)
+{
+    int size_class = 0;
+
+    // Sizes within a factor of two share the same class
+
+    while (work > 1) {
+        work >>= 1;
+        size_class++;
+    }
+
+    return size_class;
+}
+
+int tune_cache_load(int n_cpus, int size_class)
+{
+    char path[TUNE_PATH_LEN], host[TUNE_HOST_LEN], line_host[TUNE_HOST_LEN];
+    int line_cpus, line_class, line_threads, n_threads = 0;
+    FILE *file;
+
+    if (!tune_cache_path(path) || gethostname(host, TUNE_HOST_LEN) != 0) {
+        return 0;
+    }
+
+    file = fopen(path, "r");
+
+    if (!file) {
+        return 0;
+    }
+
+    // The last matching line wins, so a new calibration overrides the older ones
+
+    while (fscanf(file, "%255s %d %d %d", line_host, &line_cpus, &line_class, &line_threads) == 4) {
+        if (strcmp(line_host, host) == 0 && line_cpus == n_cpus && line_class == size_class) {
+            n_threads = line_threads;
+        }
+    }
+
+    fclose(file);
+
+    return n_threads;
+}
+
+void tune_cache_save(int n_cpus, int size_class, int n_threads)
+{
+    char path[TUNE_PATH_LEN], host[TUNE_HOST_LEN];
+    FILE *file;
+
+    // Failing to write the cache only means calibrating again the next time
+
+    if (!tune_cache_path(path) || gethostname(host, TUNE_HOST_LEN) != 0) {
+        return;
+    }
+
+    file = fopen(path, "a");
+
+    if (!file) {
+        return;
+    }
+
+    fprintf(file, "%s %d %d %d\n", host, n_cpus, size_class, n_threads);
+    fclose(file);
+}
+
+int tune_cache_path(char *path)
+{
+    char *home;
+
+    home = getenv("HOME");
+
+    if (!home) {
+        return 0;
+    }
+
+    return snprintf(path, TUNE_PATH_LEN, "%s/%s", home, TUNE_CACHE_FILE) < TUNE_PATH_LEN;
+}
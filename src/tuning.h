@@ -0,0 +1,13 @@
+#ifndef TUNING_H
+#define TUNING_H
+
+// The thread counts chosen by the calibration are cached in a file of the home
+// directory, one line per host, number of CPUs and size class of the work
+
+#define TUNE_CACHE_FILE ".segm_threads"
+
+int tune_size_class(long long work);
+int tune_cache_load(int n_cpus, int size_class);
+void tune_cache_save(int n_cpus, int size_class, int n_threads);
+
+#endif